@@ -0,0 +1,17 @@
+/*
+  Yamaha QX1 floppy drive emulator - host build
+
+  Flash tables are plain const data on the host.
+*/
+
+#ifndef _H_HOST_PGMSPACE
+#define _H_HOST_PGMSPACE
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(p)	(*(const uint8_t*)(p))
+#define pgm_read_word(p)	(*(const uint16_t*)(p))
+#define pgm_read_dword(p)	(*(const uint32_t*)(p))
+
+#endif
@@ -0,0 +1,467 @@
+/*
+  Yamaha QX1 floppy drive emulator - host build
+
+  Linux backend of the hardware abstraction layer (hal.h). The QX1 MPU is
+  simulated (see host.h) and the SD card is a directory of disk images.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "mb8877.h"
+#include "qx1.h"
+#include "hal.h"
+#include "slots.h"
+#include "crczone.h"
+#include "host.h"
+
+#define HOST_IMAGE_BLOCK	0x2000	// Card block of the first run of an image
+#define HOST_RUN_GAP		0x1000	// Card blocks from one run to the next
+#define HOST_CLUSTER		1	// Blocks per cluster: runs may end within a sector
+
+MPU	mpu;
+const char *host_dir = ".";
+const char *host_card;
+int	host_runs = 1;
+unsigned long host_latency, host_transfer;
+
+static unsigned char	bus_addr,	// X X X X A1 A0 /WR /RD, as read_qx1() sees it
+			bus_data;	// DAL
+static FILE	*disk;			// Current virtual disk, or the slot card
+static FILE	*card;			// What raw access sees: the image mapped last, or the slot card
+static unsigned long	base;		// Offset of the disk in that file
+static uint32_t	stream;			// Next card block of the multi-block read
+static unsigned int	stream_at;		// Bytes of it read so far
+static uint32_t	wstream;		// Next card block of the multi-block write
+static unsigned int	erased;		// Blocks of it pre-erased, not written yet
+static bool	wopen;			// Between writeStart() and writeStop()
+static unsigned int	fatlinks;	// FAT lookups since the last fatReads()
+static bool	present[FDC_DISKS + 1];	// DISK_nnn.QX1 found by scanSD()
+static struct slotcard slots;		// Header of the slot card
+static unsigned long	blocks = MB8877::Geometry::image_size / 512;	// Of the image, CRC zone included
+
+// ----------------------------------------------------------------------------
+// Time
+// ----------------------------------------------------------------------------
+
+unsigned long long host_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Spend us microseconds, as the card would
+static void card_spend(double us)
+{
+	unsigned long long end = host_clock() + (unsigned long long)(us * 1000);
+
+	if (us <= 0) return;
+	while (host_clock() < end);
+}
+
+// The time of one command, then n blocks
+static void card_delay(bool command, int n)
+{
+	card_spend((command ? host_latency : 0) + n * (double)host_transfer);
+}
+
+// Track the longest gap between two DRQ of the same command
+static void drq(void)
+{
+	unsigned long long now = host_clock();
+
+	mpu.drq++;
+	if (mpu.last && now - mpu.last > mpu.gap) mpu.gap = now - mpu.last;
+	mpu.last = now;
+}
+
+// ----------------------------------------------------------------------------
+// Simulated MPU
+// ----------------------------------------------------------------------------
+
+static unsigned char mpu_address(int r)
+{
+	return (r == CMD || r == STATUS) ? 0 : r << 2;
+}
+
+// One DATA access for the DRQ line, as long as the MPU has room (read) or
+// data (write); past that, it leaves the DRQ unanswered as if it had been
+// too slow, and the core raises LOSTDATA after FDC_LOST_TIMEOUT. At
+// mpu.cut, it writes FORCE INTERRUPT instead, the command still running.
+static void mpu_serve(void)
+{
+	if (! mpu.drqline) return;
+	if (mpu.writing && mpu.cut && mpu.txpos == mpu.cut)
+	{
+		mpu.cut = 0;
+		bus_addr = mpu_address(CMD) | 0x01;
+		bus_data = 0xd0;
+		read_qx1();
+		return;
+	}
+	if (mpu.writing ? mpu.txpos >= mpu.txlen : mpu.rxlen >= mpu.rxmax) return;
+	drq();
+	if ((mpu_read(STATUS) & (FDC_ST_BUSY|FDC_ST_DRQ)) != (FDC_ST_BUSY|FDC_ST_DRQ))
+		mpu.stale++;			// The MPU polls STATUS before DATA
+	if (mpu.writing)
+		mpu_write(DATA, mpu.tx[mpu.txpos++]);
+	else
+		mpu.rx[mpu.rxlen++] = mpu_read(DATA);
+}
+
+// Writing CMD also plays the MPU waiting for the command: the core is
+// stepped as loop() does until BUSY drops, and the MPU answers DRQ at one
+// byte per step, so the FIFO only runs dry when a step falls behind
+void mpu_write(int r, unsigned char value)
+{
+	if (r == CMD)
+	{
+		mpu.last = 0;			// DRQ gaps are measured within a command
+		mpu.writing = (value & 0xe0) == 0xa0 || (value & 0xf0) == 0xf0;
+	}
+	bus_addr = mpu_address(r) | 0x01;
+	bus_data = value;
+	read_qx1();
+	if (r == CMD)
+		while (mb8877.reg[STATUS] & FDC_ST_BUSY)
+		{
+			mb8877.step();
+			mpu_serve();
+		}
+}
+
+unsigned char mpu_read(int r)
+{
+	bus_addr = mpu_address(r) | 0x02;
+	read_qx1();
+	return bus_data;
+}
+
+void mpu_receive(unsigned char *buf, size_t len)
+{
+	mpu.rx = buf;
+	mpu.rxmax = len;
+	mpu.rxlen = 0;
+}
+
+void mpu_send(const unsigned char *buf, size_t len)
+{
+	mpu.tx = buf;
+	mpu.txlen = len;
+	mpu.txpos = 0;
+	mpu.cut = 0;
+}
+
+// ----------------------------------------------------------------------------
+// Bus port
+// ----------------------------------------------------------------------------
+
+void begin_qx1(void)
+{
+	mpu.drqline = mpu.irq = false;
+}
+
+void drq_qx1(bool level)
+{
+	mpu.drqline = level;
+}
+
+unsigned long time_qx1(void)
+{
+	return host_clock() / 1000;
+}
+
+void read_qx1()
+{
+	switch(bus_addr)
+	{
+		case 0x01: mb8877.reg[CMD] = bus_data; mb8877.command(); break;
+		case 0x05: mb8877.reg[TRACK] = bus_data; break;
+		case 0x09: mb8877.reg[SECTOR] = bus_data; break;
+		case 0x0d: mb8877.reg[DATA] = bus_data; mb8877.served(); break;
+
+		case 0x02: bus_data = mb8877.reg[STATUS]; break;
+		case 0x06: bus_data = mb8877.reg[TRACK]; break;
+		case 0x0a: bus_data = mb8877.reg[SECTOR]; break;
+		case 0x0e: bus_data = mb8877.reg[DATA]; mb8877.served(); break;
+	}
+}
+
+void irq_qx1(bool level)
+{
+	mpu.irq = level;
+}
+
+// ----------------------------------------------------------------------------
+// Block device: a directory stands for the card
+// ----------------------------------------------------------------------------
+//	With host_card set, the card is a slot card image instead (see slots.h):
+//	disks are read and written at their block in that file.
+
+static bool scanSlots(void)
+{
+	FILE	*f = fopen(host_card, "rb");
+	bool	ok;
+	int	i;
+
+	ok = f && fread(&slots, sizeof(slots), 1, f) == 1
+		&& ! memcmp(slots.magic, SLOT_MAGIC, sizeof(slots.magic))
+		&& slots.version == SLOT_VERSION && slots.disks == FDC_DISKS + 1
+		&& slots.stride >= MB8877::Geometry::image_size / SLOT_BLOCK;
+	if (f) fclose(f);
+	for (i = 0; ok && i <= FDC_DISKS; i++)
+		present[i] = slots.present[i >> 3] & (1 << (i & 7));
+	return ok;
+}
+
+void scanSD()
+{
+	DIR	*dir;
+	struct dirent *entry;
+	int	i;
+
+	memset(present, 0, sizeof(present));
+	if (host_card)
+	{
+		mb8877.reg[STATUS] = scanSlots() ? 0x00 : FDC_ST_NOTREADY;
+		return;
+	}
+	dir = opendir(host_dir);
+	mb8877.reg[STATUS] = dir ? 0x00 : FDC_ST_NOTREADY;
+	if (! dir) return;
+	while ((entry = readdir(dir)))
+		if (sscanf(entry->d_name, "DISK_%3d.QX1", &i) == 1 && i >= 0 && i <= FDC_DISKS)
+			present[i] = true;
+	closedir(dir);
+}
+
+int findDisk(int n, int step)
+{
+	if (mb8877.reg[STATUS] & FDC_ST_NOTREADY) return -1;
+	for (; n >= 0 && n <= FDC_DISKS; n += step)
+		if (present[n]) return n;
+	return -1;
+}
+
+static FILE *image(int n, const char *mode)
+{
+	char	path[1024];
+
+	if (findDisk(n, 1) != n) return NULL;
+	if (host_card) return fopen(host_card, mode);
+	snprintf(path, sizeof(path), "%s/DISK_%03d.QX1", host_dir, n);
+	return fopen(path, mode);
+}
+
+// Image blocks per run when an image is split in host_runs runs; odd, so
+// that runs end within zone 0 sectors
+static unsigned int run_length(void)
+{
+	return ((blocks + host_runs - 1) / host_runs) | 1;
+}
+
+// Runs are laid out on the simulated card backwards, HOST_RUN_GAP apart:
+// the stream only carries on from one to the next if the map says so.
+static uint32_t run_block(int k)
+{
+	int	runs = (blocks + run_length() - 1) / run_length();
+
+	return HOST_IMAGE_BLOCK + (runs - 1 - k) * HOST_RUN_GAP;
+}
+
+// Offset in the open file of a card block, -1 if it holds no image data
+static long card_offset(uint32_t block)
+{
+	unsigned int	k, length = run_length();
+
+	if (host_card) return block * 512L;
+	for (k = 0; k * length < blocks; k++)
+		if (block >= run_block(k) && block < run_block(k) + length && k * length + block - run_block(k) < blocks)
+			return (k * length + block - run_block(k)) * 512L;
+	return -1;
+}
+
+// Links SdFile would follow through the FAT to move in the file
+static void fat_walk(unsigned long from, unsigned long to)
+{
+	unsigned long	size = HOST_CLUSTER * 512UL;
+
+	if (host_card) return;
+	if (to / size < from / size) from = 0;
+	fatlinks += to / size - from / size;
+}
+
+bool disk_open(int n)
+{
+	disk_close();
+	if ((disk = image(n, "r+b"))) setvbuf(disk, NULL, _IONBF, 0);
+	base = host_card ? (slots.first + n * slots.stride) * 512UL : 0;
+	return disk != NULL;
+}
+
+void disk_close(void)
+{
+	if (disk) fclose(disk);
+	disk = NULL;
+}
+
+bool disk_seek(unsigned long offset)
+{
+	struct stat	st;
+
+	if (! disk) return false;
+	if (! host_card && (fstat(fileno(disk), &st) || offset > (unsigned long)st.st_size))
+		return false;			// As SdFile: not past the end
+	fat_walk(ftell(disk) - base, offset);
+	return fseek(disk, base + offset, SEEK_SET) == 0;
+}
+
+int disk_read(unsigned char *buf, int n)
+{
+	card_delay(true, (n + 511) / 512);
+	if (! disk) return -1;
+	fat_walk(ftell(disk) - base, ftell(disk) - base + n);
+	return fread(buf, 1, n, disk);
+}
+
+int disk_write(const unsigned char *buf, int n)
+{
+	card_delay(true, (n + 511) / 512);
+	if (! disk) return -1;
+	fat_walk(ftell(disk) - base, ftell(disk) - base + n);
+	return fwrite(buf, 1, n, disk);		// Unbuffered: SdFile writes whole blocks past its cache
+}
+
+void disk_flush(void)
+{
+	if (disk) fflush(disk);
+}
+
+// What raw access reads and writes from now on: stays open whatever
+// becomes of the File of the disk, as the SD card does on the AVR.
+// Unbuffered, like the disk, so each sees the other's writes at once.
+static void open_card(int n)
+{
+	if (card) fclose(card);
+	if ((card = image(n, "r+b"))) setvbuf(card, NULL, _IONBF, 0);
+}
+
+// The image is split in host_runs runs (see run_block()); mapping it walks
+// the whole chain once. Slot card disks are a single run, at the block
+// given by the header, up to the end of the CRC zone if the slot has room.
+int imageMap(int n, struct extent *map, int max)
+{
+	struct stat	st;
+	FILE	*f;
+	int	k;
+
+	open_card(n);
+	if (host_card)
+	{
+		if (findDisk(n, 1) != n) return 0;
+		blocks = MB8877::Geometry::image_size / 512 + CRCZONE_BLOCKS(MB8877::Geometry::sector_count);
+		if (blocks > slots.stride) blocks = slots.stride;
+		map->block = slots.first + n * slots.stride;
+		map->length = blocks;
+		return 1;
+	}
+	if (! (f = image(n, "rb"))) return 0;
+	blocks = fstat(fileno(f), &st) ? 0 : st.st_size / 512;
+	fclose(f);
+	fatlinks += blocks / HOST_CLUSTER;
+	for (k = 0; k * run_length() < blocks; k++)
+	{
+		if (k == max) return 0;
+		map[k].block = run_block(k);
+		map[k].length = run_length();
+	}
+	return k;
+}
+
+unsigned int fatReads(void)
+{
+	unsigned int	n = fatlinks;
+
+	fatlinks = 0;
+	return n;
+}
+
+uint8_t streamStart(uint32_t block)
+{
+	if (! card) return 0;
+	stream = block;
+	card_delay(true, 0);
+	return 1;
+}
+
+uint8_t streamBlock(void)
+{
+	stream_at = 0;
+	return card != NULL;
+}
+
+// Blocks outside the image read as whatever else is on the card. The
+// transfer time of the card goes by the byte.
+uint8_t streamChunk(uint8_t *dst, uint16_t n)
+{
+	long	offset = card_offset(stream);
+
+	if (stream_at + n > 512) return 0;
+	card_spend(host_transfer * n / 512.0);
+	if (offset >= 0 && (fseek(card, offset + stream_at, SEEK_SET) || fread(dst, 1, n, card) != n)) return 0;
+	if (offset < 0) memset(dst, 0xe5, n);
+	if ((stream_at += n) == 512) stream++;
+	return 1;
+}
+
+void streamStop(void)
+{
+}
+
+// The card command of a multi-block write once, then the transfer time of
+// each block. Blocks pre-erased and not written when it stops read as
+// 0xff, as they may on a card: a pre-erase count past the end of what the
+// core writes shows in the reads that follow.
+uint8_t writeStart(uint32_t block, uint16_t count)
+{
+	if (! card) return 0;
+	wstream = block;
+	erased = count;
+	wopen = true;
+	card_delay(true, 0);
+	return 1;
+}
+
+uint8_t writeBlock(const uint8_t *src)
+{
+	long	offset = card_offset(wstream);
+
+	card_delay(false, 1);
+	if (! card || offset < 0 || fseek(card, offset, SEEK_SET) || fwrite(src, 1, 512, card) != 512) return 0;
+	wstream++;
+	if (erased) erased--;
+	return 1;
+}
+
+void writeStop(void)
+{
+	unsigned char	blank[512];
+	long	offset;
+
+	memset(blank, 0xff, sizeof(blank));
+	for (; erased && card; erased--, wstream++)
+		if ((offset = card_offset(wstream)) >= 0 && ! fseek(card, offset, SEEK_SET))
+			fwrite(blank, 1, sizeof(blank), card);
+	erased = 0;
+	wopen = false;
+}
+
+bool host_writing(void)
+{
+	return wopen;
+}
@@ -0,0 +1,45 @@
+/*
+  Yamaha QX1 floppy drive emulator - host build
+
+  Simulated side of the bus: hal_host.cpp implements hal.h on Linux and
+  plays the QX1 MPU. The MPU reads and writes the FDC registers the way the
+  real one does through A0/A1, /RD and /WR; bytes served on DRQ during a
+  read command land in mpu.rx, bytes the FDC asks for during a write
+  command come from mpu.tx.
+*/
+
+#ifndef _H_HOST
+#define _H_HOST
+
+#include <stddef.h>
+
+struct MPU {
+	unsigned char	*rx;		// Receives the bytes of read commands
+	size_t		rxlen, rxmax;
+	const unsigned char *tx;	// Feeds the bytes of write commands
+	size_t		txlen, txpos;
+	size_t		cut;		// FORCE INTERRUPT once that many bytes of tx are sent (0: none)
+	bool		writing,	// The command in progress writes (DRQ feeds it)
+			irq,		// Level of the IRQ line
+			drqline;	// Level of the DRQ line
+	unsigned long	drq,		// DRQ served since start
+			stale;		// DRQ while STATUS did not show BUSY and DRQ
+	unsigned long long last,	// Time of the last DRQ of the current command (ns)
+			gap;		// Longest time between two DRQ of a command (ns)
+};
+
+extern MPU	mpu;
+extern const char *host_dir;		// Directory holding the DISK_nnn.QX1 images
+extern const char *host_card;		// Slot card image used instead, if set
+extern int	host_runs;		// Runs of card blocks each image is split in (1: contiguous)
+extern unsigned long host_latency;	// Simulated card command latency (us)
+extern unsigned long host_transfer;	// Simulated card time per 512 bytes block (us)
+
+void	mpu_write(int, unsigned char);	// MPU writes a register (CMD, TRACK, SECTOR, DATA); CMD waits for the end
+unsigned char mpu_read(int);		// MPU reads a register (STATUS, TRACK, SECTOR, DATA)
+void	mpu_receive(unsigned char*, size_t);	// Where the next read command goes
+void	mpu_send(const unsigned char*, size_t);	// What the next write command gets
+unsigned long long host_clock(void);		// Monotonic time (ns)
+bool	host_writing(void);			// A multi-block write is open on the card
+
+#endif
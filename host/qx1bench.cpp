@@ -0,0 +1,167 @@
+/*
+  Yamaha QX1 floppy drive emulator - host build
+
+  Command throughput benchmark: runs each command of the decode_command()
+  dispatch against a disk image, with a simulated card latency, and reports
+  commands/s, bytes/s, the worst gap between two DRQ of a command and the
+  FAT lookups per command.
+
+  Usage: qx1bench [-f runs] [-l usec] [-t usec] [-n count] <dir> <disk>
+	-f	split the image in <runs> runs on the card (default 1); past
+		FDC_EXTENTS it cannot be mapped and goes through the FAT
+	-l	card latency per command, in microseconds (default 0)
+	-t	card transfer time per 512 bytes block, in microseconds (default 0)
+	-n	commands per benchmark (default 200)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mb8877.h"
+#include "qx1.h"
+#include "crc.h"
+#include "hal.h"
+#include "host.h"
+
+static unsigned char	rx[2 * FDC_SIZE_TRACK_0];
+static unsigned char	tx[FDC_SIZE_TRACK_0 / 2];		// A side: WRITE MULTIPLE SECTOR from sector 0
+static int	count = 200;
+
+// Spread the accesses over both zones
+static int track(int i)
+{
+	return (i * 37) % FDC_TRACKS;
+}
+
+static void seek(int t)
+{
+	mpu_write(DATA, t);
+	mpu_write(CMD, 0x10);
+}
+
+// One benchmark: setup() runs before each command, untimed
+static void bench(const char *name, unsigned char cmd, void (*setup)(int))
+{
+	unsigned long long start, elapsed = 0;
+	unsigned long	drq = mpu.drq, bytes = 0, fatreads = 0, underruns = mb8877.stats.underruns;
+	int	i;
+
+	mpu.gap = 0;
+	for (i = 0; i < count; i++)
+	{
+		if (setup) setup(i);
+		mpu_receive(rx, sizeof(rx));
+		mpu_send(tx, sizeof(tx));
+		start = host_clock();
+		mpu_write(CMD, cmd);
+		elapsed += host_clock() - start;
+		fatreads += mb8877.fatreads;
+	}
+	bytes = mpu.drq - drq;
+	if (! elapsed) elapsed = 1;
+	printf("%-22s %6d %12.0f %12.0f %12.1f %9.1f %9.1f\n", name, count,
+		count * 1e9 / elapsed, bytes * 1e9 / elapsed, mpu.gap / 1e3, (double)fatreads / count,
+		(double)(mb8877.stats.underruns - underruns) / count);
+}
+
+static void at_track(int i)		{ seek(track(i)); mpu_write(SECTOR, 0); }
+static void at_sector(int i)		{ seek(track(i)); mpu_write(SECTOR, i % FDC_SECTORS_0); }
+static void to_track(int i)		{ mpu_write(DATA, track(i)); }
+static void away_from_end(int i)	{ if (i % FDC_TRACKS == 0) seek(0); }
+static void away_from_start(int i)	{ if (i % FDC_TRACKS == 0) seek(FDC_TRACKS - 1); }
+
+// Cycles per byte of each CRC on the ATmega328, counted by hand from the
+// instructions avr-gcc -Os makes of them (no AVR timer on the host):
+//	table:	ld 2, eor 1, index (mov, clr, lsl, rol, subi, sbci) 6,
+//		lpm + lpm 6, shift and eor 2, loop (cp, cpc, brne) 4
+//	bit loop: ld + eor 3, ldi 1, 8 x (lsl, rol, brcc, eor, eor, dec,
+//		brne) 64 with the polynomial every time (7 a bit without), loop 4
+#define AVR_CRC_TABLE	21
+#define AVR_CRC_LOOP	72
+#define AVR_MHZ		16
+
+// CRC of a zone 0 sector: table driven bulk compute against the bit loop.
+// The host figures are nanoseconds of host time per byte, for the two to
+// be compared with each other on the host; they say nothing of the AVR,
+// whose cycles per byte come from the counts above.
+static void bench_crc(void)
+{
+	unsigned long long start, table, loop;
+	unsigned short	w = 0xffff;
+	unsigned char	t;
+	CRC	crc;
+	int	i, j;
+
+	for (i = 0; i < FDC_SIZE_SECTOR_0; i++) tx[i] = i * 7;
+	start = host_clock();
+	for (j = 0; j < count * 10; j++) crc.compute(tx, FDC_SIZE_SECTOR_0);
+	table = host_clock() - start;
+
+	start = host_clock();
+	for (j = 0; j < count * 10; j++)
+		for (i = 0; i < FDC_SIZE_SECTOR_0; i++)
+		{
+			w ^= tx[i] << 8;
+			t = 8;
+			do w = (w & 0x8000) ? (w << 1) ^ 0x1021 : w << 1; while (--t);
+		}
+	loop = host_clock() - start;
+
+	printf("\n%-22s %6s %12s %12s %12s\n", "CRC of a zone 0 sector", "count", "host ns/byte",
+		"AVR cyc/byte", "AVR us/sect");
+	printf("%-22s %6d %12.2f %12d %12d\n", "CRC table", count * 10,
+		(double)table / (count * 10.0 * FDC_SIZE_SECTOR_0), AVR_CRC_TABLE, AVR_CRC_TABLE * FDC_SIZE_SECTOR_0 / AVR_MHZ);
+	printf("%-22s %6d %12.2f %12d %12d  (check %04x = %02x%02x)\n", "CRC bit loop", count * 10,
+		(double)loop / (count * 10.0 * FDC_SIZE_SECTOR_0), AVR_CRC_LOOP, AVR_CRC_LOOP * FDC_SIZE_SECTOR_0 / AVR_MHZ,
+		w, crc.msb(), crc.lsb());
+	printf("(host ns are wall time on this machine; AVR figures are hand counts at %d MHz)\n", AVR_MHZ);
+}
+
+int main(int argc, char **argv)
+{
+	int	c, n;
+
+	while ((c = getopt(argc, argv, "f:l:t:n:")) != -1)
+		switch (c)
+		{
+			case 'f': host_runs = atoi(optarg); break;
+			case 'l': host_latency = strtoul(optarg, NULL, 0); break;
+			case 't': host_transfer = strtoul(optarg, NULL, 0); break;
+			case 'n': count = atoi(optarg); break;
+			default: return 2;
+		}
+	if (argc - optind != 2 || count <= 0)
+	{
+		fprintf(stderr, "usage: qx1bench [-f runs] [-l usec] [-t usec] [-n count] <dir> <disk>\n");
+		return 2;
+	}
+	host_dir = argv[optind];
+	n = atoi(argv[optind + 1]);
+
+	begin_qx1();
+	scanSD();
+	mb8877.insert(n);
+	mpu_write(CMD, 0x00);
+	if (mb8877.reg[STATUS] & FDC_ST_NOTREADY || ! (mb8877.reg[STATUS] & FDC_ST_TRACK00))
+	{
+		fprintf(stderr, "qx1bench: cannot open DISK_%03d.QX1 in %s\n", n, host_dir);
+		return 1;
+	}
+
+	printf("card latency %lu us/command, %lu us/block, image in %d run(s)\n\n", host_latency, host_transfer, host_runs);
+	printf("%-22s %6s %12s %12s %12s %9s %9s\n", "command", "count", "commands/s", "bytes/s", "max gap us", "FAT/cmd", "dry/cmd");
+	bench("RESTORE", 0x00, NULL);
+	bench("SEEK", 0x10, to_track);
+	bench("STEP IN", 0x50, away_from_end);
+	bench("STEP OUT", 0x70, away_from_start);
+	bench("READ SECTOR", 0x80, at_sector);
+	bench("READ MULTIPLE SECTOR", 0x90, at_track);
+	bench("WRITE SECTOR", 0xa0, at_sector);
+	bench("WRITE MULTIPLE SECTOR", 0xb0, at_track);
+	bench("READ ADDRESS", 0xc0, at_track);
+	bench("READ TRACK", 0xe0, at_track);
+	bench_crc();
+	return 0;
+}
@@ -0,0 +1,482 @@
+/*
+  Yamaha QX1 floppy drive emulator - host build
+
+  Offline tool for slot cards (see qx1/slots.h): the virtual disks at fixed
+  blocks of the card, behind a header in block 0. <card> is an image file
+  to write to the SD card with dd, or the card device itself. Also builds
+  and checks the CRC zone of an image (see qx1/crczone.h), and converts
+  images between the raw layout and version 2 (see qx1/image.h), sparse
+  or not. Images are read in either format; slots hold the raw layout.
+
+  Usage: qx1img slots <card> <dir>	create <card>, or update it, with the
+					DISK_nnn.QX1 images found in <dir>
+	 qx1img list <card>		list the disks of <card>
+	 qx1img extract <card> <dir>	copy the disks of <card> to <dir>
+	 qx1img crc <image>...		(re)write the CRC zone of each image
+	 qx1img verify <image>...	check the CRC zone of each image
+	 qx1img sparse <image>...	make each image sparse (version 2)
+	 qx1img v2 <in> <out>		convert an image to version 2
+	 qx1img raw <in> <out>		convert an image to the raw layout
+					(- for standard input or output)
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "qx1.h"
+#include "crc.h"
+#include "crczone.h"
+#include "geometry.h"
+#include "image.h"
+#include "slots.h"
+
+typedef FDC_GEOMETRY	Disk;
+
+#define ZONE_SIZE	(CRCZONE_BLOCKS(Disk::sector_count) * SLOT_BLOCK)
+#define FULL_SIZE	(FDC_IMAGE_SIZE + ZONE_SIZE)
+
+static unsigned char	image[FULL_SIZE];	// Image, then its CRC zone if any
+static struct qx1image	head;			// Header of the last image read, if version 2,
+static unsigned char	head_block[SLOT_BLOCK];	// and its block, sector bits included
+
+static bool present(const struct slotcard *h, int n)
+{
+	return h->present[n >> 3] & (1 << (n & 7));
+}
+
+static unsigned long slot(const struct slotcard *h, int n)
+{
+	return (h->first + (unsigned long)n * h->stride) * SLOT_BLOCK;
+}
+
+// Read the header of card; false if it is not a slot card
+static bool header(FILE *card, struct slotcard *h)
+{
+	return fseek(card, 0, SEEK_SET) == 0 && fread(h, sizeof(*h), 1, card) == 1
+		&& ! memcmp(h->magic, SLOT_MAGIC, sizeof(h->magic))
+		&& h->version == SLOT_VERSION && h->disks == FDC_DISKS + 1
+		&& h->first && h->stride >= FDC_IMAGE_SIZE / SLOT_BLOCK;
+}
+
+// Header of a version 2 image for this geometry at the start of block;
+// false for a raw image
+static bool header(const unsigned char *block, struct qx1image *h)
+{
+	memcpy(h, block, sizeof(*h));
+	return ! memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) && h->version == IMAGE_VERSION
+		&& h->head && h->sectors == Disk::sector_count && h->blocks == FDC_IMAGE_SIZE / SLOT_BLOCK
+		&& h->sides == Disk::sides && h->tracks == Disk::tracks;
+}
+
+// A version 2 header for this geometry, not sparse, into block
+static void new_header(unsigned char *block)
+{
+	struct qx1image h;
+
+	memset(block, 0, SLOT_BLOCK);
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+	h.version = IMAGE_VERSION;
+	h.head = IMAGE_HEAD;
+	h.sectors = Disk::sector_count;
+	h.blocks = FDC_IMAGE_SIZE / SLOT_BLOCK;
+	h.sides = Disk::sides;
+	h.tracks = Disk::tracks;
+	memcpy(block, &h, sizeof(h));
+}
+
+// Read an image file into image, past its header if version 2 (kept in
+// head): its size, with or without the CRC zone; 0 if missing or of
+// neither size
+static size_t read_image(const char *path)
+{
+	unsigned char	block[SLOT_BLOCK];
+	FILE	*f;
+	size_t	size;
+
+	memset(&head, 0, sizeof(head));
+	if (! (f = fopen(path, "rb"))) return 0;
+	if (fread(block, 1, SLOT_BLOCK, f) != SLOT_BLOCK || ! header(block, &head))
+	{
+		memset(&head, 0, sizeof(head));
+		rewind(f);
+	}
+	else
+	{
+		memcpy(head_block, block, SLOT_BLOCK);
+		fseek(f, (long)head.head * SLOT_BLOCK, SEEK_SET);
+	}
+	size = fread(image, 1, FULL_SIZE, f);
+	if (fgetc(f) != EOF || (size != FDC_IMAGE_SIZE && size != FULL_SIZE)) size = 0;
+	fclose(f);
+	if (! size) fprintf(stderr, "qx1img: %s is not a %d bytes image, skipped\n", path, FDC_IMAGE_SIZE);
+	return size;
+}
+
+// The header blocks of the last image read, as read_image() found them
+static bool write_header(FILE *f)
+{
+	unsigned char	block[SLOT_BLOCK];
+	int	i;
+
+	if (fwrite(head_block, 1, SLOT_BLOCK, f) != SLOT_BLOCK) return false;
+	memset(block, 0, SLOT_BLOCK);
+	for (i = 1; i < head.head; i++)
+		if (fwrite(block, 1, SLOT_BLOCK, f) != SLOT_BLOCK) return false;
+	return true;
+}
+
+// Whether sector i holds nothing but byte
+static bool blank(unsigned int i, unsigned char byte)
+{
+	unsigned long	at;
+
+	for (at = Disk::sector_offset(i); at < Disk::sector_offset(i + 1); at++)
+		if (image[at] != byte) return false;
+	return true;
+}
+
+// Whether sector i may hold anything but the fill byte: always, unless the
+// last image read is sparse and the bit of the sector is clear
+static bool used(unsigned int i)
+{
+	return ! (head.flags & IMAGE_SPARSE) || (head_block[IMAGE_USED + i / 8] & (1 << (i & 7)));
+}
+
+// Read DISK_nnn.QX1 from dir into image: its size, 0 if missing or wrong
+static size_t load(const char *dir, int n)
+{
+	char	path[1024];
+
+	snprintf(path, sizeof(path), "%s/DISK_%03d.QX1", dir, n);
+	if (access(path, F_OK)) return 0;
+	return read_image(path);
+}
+
+// CRC of the data field of sector i of image
+static unsigned int sector_crc(unsigned int i)
+{
+	static const unsigned char	mark[4] = {0xa1, 0xa1, 0xa1, 0xfb};
+	CRC	crc;
+
+	crc.compute(mark, 4);
+	crc.compute(image + Disk::sector_offset(i), Disk::sector_offset(i + 1) - Disk::sector_offset(i));
+	return crc.msb() << 8 | crc.lsb();
+}
+
+static int slots(const char *path, const char *dir)
+{
+	unsigned char	block[SLOT_BLOCK];
+	struct slotcard h;
+	struct stat	st;
+	FILE	*card = fopen(path, "r+b");
+	size_t	size;
+	int	n, copied = 0;
+
+	if (! card && ! (card = fopen(path, "w+b")))
+	{
+		perror(path);
+		return 1;
+	}
+	if (! header(card, &h))				// New card
+	{
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, SLOT_MAGIC, sizeof(h.magic));
+		h.version = SLOT_VERSION;
+		h.disks = FDC_DISKS + 1;
+		h.first = SLOT_FIRST;
+		h.stride = SLOT_STRIDE;
+	}
+
+	for (n = 0; n <= FDC_DISKS; n++)
+	{
+		if (! (size = load(dir, n))) continue;
+		if (h.stride * SLOT_BLOCK < FULL_SIZE)	// No room for the zone in the slots
+			size = FDC_IMAGE_SIZE;
+		else if (size == FDC_IMAGE_SIZE)	// Clear the zone a previous disk may have left
+		{
+			memset(image + FDC_IMAGE_SIZE, 0, SLOT_BLOCK);
+			size += SLOT_BLOCK;
+		}
+		if (fseek(card, slot(&h, n), SEEK_SET) || fwrite(image, 1, size, card) != size)
+		{
+			perror(path);
+			return 1;
+		}
+		h.present[n >> 3] |= 1 << (n & 7);
+		copied++;
+	}
+
+	// The card must be as large as its last slot, so the firmware accepts it
+	if (fstat(fileno(card), &st) == 0 && S_ISREG(st.st_mode) && (unsigned long)st.st_size < slot(&h, h.disks))
+		if (ftruncate(fileno(card), slot(&h, h.disks)))
+			perror(path);
+
+	memset(block, 0, sizeof(block));
+	memcpy(block, &h, sizeof(h));
+	if (fseek(card, 0, SEEK_SET) || fwrite(block, 1, sizeof(block), card) != sizeof(block) || fclose(card))
+	{
+		perror(path);
+		return 1;
+	}
+	printf("qx1img: %d disks copied to %s\n", copied, path);
+	return 0;
+}
+
+static int list(const char *path)
+{
+	struct slotcard h;
+	FILE	*card = fopen(path, "rb");
+	int	n;
+
+	if (! card || ! header(card, &h))
+	{
+		fprintf(stderr, "qx1img: %s is not a slot card\n", path);
+		return 1;
+	}
+	printf("%s: slots of %lu blocks from block %lu\n", path, (unsigned long)h.stride, (unsigned long)h.first);
+	for (n = 0; n <= FDC_DISKS; n++)
+		if (present(&h, n))
+			printf("DISK_%03d.QX1\tblock %lu\n", n, slot(&h, n) / SLOT_BLOCK);
+	fclose(card);
+	return 0;
+}
+
+static int extract(const char *path, const char *dir)
+{
+	struct slotcard h;
+	char	name[1024];
+	FILE	*card = fopen(path, "rb"), *f;
+	size_t	size;
+	int	n;
+
+	if (! card || ! header(card, &h))
+	{
+		fprintf(stderr, "qx1img: %s is not a slot card\n", path);
+		return 1;
+	}
+	for (n = 0; n <= FDC_DISKS; n++)
+	{
+		if (! present(&h, n)) continue;
+		snprintf(name, sizeof(name), "%s/DISK_%03d.QX1", dir, n);
+		if (fseek(card, slot(&h, n), SEEK_SET) || fread(image, 1, FDC_IMAGE_SIZE, card) != FDC_IMAGE_SIZE
+		 || ! (f = fopen(name, "wb")))
+		{
+			perror(name);
+			return 1;
+		}
+		size = FDC_IMAGE_SIZE;
+		if (h.stride * SLOT_BLOCK >= FULL_SIZE && fread(image + size, 1, ZONE_SIZE, card) == ZONE_SIZE
+		 && ! memcmp(image + size, CRCZONE_MAGIC, 6))
+			size = FULL_SIZE;		// The disk has its CRC zone
+		fwrite(image, 1, size, f);
+		if (fclose(f))
+		{
+			perror(name);
+			return 1;
+		}
+	}
+	fclose(card);
+	return 0;
+}
+
+// Write the CRC zone of an image file, from its data
+static int crc(const char *path)
+{
+	struct crczone	z;
+	unsigned char	*entry = image + FDC_IMAGE_SIZE + CRCZONE_HEAD;
+	unsigned int	i, v;
+	FILE	*f;
+
+	if (! read_image(path)) return 1;
+	memset(image + FDC_IMAGE_SIZE, 0, ZONE_SIZE);
+	memcpy(z.magic, CRCZONE_MAGIC, sizeof(z.magic));
+	z.sectors = Disk::sector_count;
+	memcpy(image + FDC_IMAGE_SIZE, &z, sizeof(z));
+	for (i = 0; i < Disk::sector_count; i++)
+	{
+		v = sector_crc(i);
+		*entry++ = v >> 8;
+		*entry++ = v;
+	}
+	if (! (f = fopen(path, "wb")) || (head.head && ! write_header(f))
+	 || fwrite(image, 1, FULL_SIZE, f) != FULL_SIZE || fclose(f))
+	{
+		perror(path);
+		return 1;
+	}
+	printf("%s: %u sectors\n", path, Disk::sector_count);
+	return 0;
+}
+
+// Check the CRC zone of an image file against its data, and the sector
+// bits of a sparse one
+static int verify(const char *path)
+{
+	struct crczone	z;
+	const unsigned char	*entry = image + FDC_IMAGE_SIZE + CRCZONE_HEAD;
+	unsigned int	i, bad = 0;
+
+	if (read_image(path) != FULL_SIZE)
+	{
+		fprintf(stderr, "qx1img: %s has no CRC zone\n", path);
+		return 1;
+	}
+	memcpy(&z, image + FDC_IMAGE_SIZE, sizeof(z));
+	if (memcmp(z.magic, CRCZONE_MAGIC, sizeof(z.magic)) || z.sectors != Disk::sector_count)
+	{
+		fprintf(stderr, "qx1img: %s: bad CRC zone header\n", path);
+		return 1;
+	}
+	for (i = 0; i < Disk::sector_count; i++, entry += 2)
+		if ((unsigned int)(entry[0] << 8 | entry[1]) != sector_crc(i))
+		{
+			if (bad++ < 10) printf("%s: sector %u (offset %lu): CRC %02x%02x, data %04x\n",
+				path, i, Disk::sector_offset(i), entry[0], entry[1], sector_crc(i));
+		}
+		else if (! used(i) && ! blank(i, head.fill))
+		{
+			if (bad++ < 10) printf("%s: sector %u (offset %lu): not blank, its bit is clear\n",
+				path, i, Disk::sector_offset(i));
+		}
+	printf("%s: %u sectors, %u wrong\n", path, Disk::sector_count, bad);
+	return bad != 0;
+}
+
+// Make an image sparse: version 2, the fill byte the one most blank sectors
+// hold, and the bit of every other sector set
+static int sparse(const char *path)
+{
+	unsigned int	count[256], i, fill = 0xe5, n = 0;
+	unsigned char	byte;
+	size_t	size;
+	FILE	*f;
+
+	if (! (size = read_image(path))) return 1;
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < Disk::sector_count; i++)
+		if (blank(i, byte = image[Disk::sector_offset(i)])) count[byte]++;
+	for (i = 0; i < 256; i++)
+		if (count[i] > count[fill]) fill = i;
+
+	if (! head.head)				// Raw image: version 2 from now on
+	{
+		new_header(head_block);
+		memcpy(&head, head_block, sizeof(head));
+	}
+	head.flags |= IMAGE_SPARSE;
+	head.fill = fill;
+	memcpy(head_block, &head, sizeof(head));
+	memset(head_block + IMAGE_USED, 0, SLOT_BLOCK - IMAGE_USED);
+	for (i = 0; i < Disk::sector_count; i++)
+		if (blank(i, fill)) n++;
+		else head_block[IMAGE_USED + i / 8] |= 1 << (i & 7);
+
+	if (! (f = fopen(path, "wb")) || ! write_header(f) || fwrite(image, 1, size, f) != size || fclose(f))
+	{
+		perror(path);
+		return 1;
+	}
+	printf("%s: %u of %u sectors blank (%02x)\n", path, n, Disk::sector_count, fill);
+	return 0;
+}
+
+// Copy an image from in to out in the raw layout, or with a version 2
+// header: one block at a time, so either may be a pipe. The input is in
+// either format (a version 2 header, sector bits included, is kept as it
+// is); its data must be whole, its CRC zone, if any, too.
+static int convert(const char *from, const char *to, bool v2)
+{
+	unsigned char	block[SLOT_BLOCK], head[SLOT_BLOCK];
+	struct qx1image h;
+	FILE	*in = strcmp(from, "-") ? fopen(from, "rb") : stdin,
+		*out;
+	unsigned long	n = 0, skip = 0;
+	bool	first = true;
+	size_t	got;
+
+	if (! in)
+	{
+		perror(from);
+		return 1;
+	}
+	if (! (out = strcmp(to, "-") ? fopen(to, "wb") : stdout))
+	{
+		perror(to);
+		return 1;
+	}
+	while ((got = fread(block, 1, SLOT_BLOCK, in)) == SLOT_BLOCK)
+	{
+		if (first && header(block, &h))		// Version 2 input: its header as it is
+		{
+			first = false;
+			skip = h.head;
+		}
+		else if (first && v2)
+		{
+			first = false;
+			new_header(head);
+			if (fwrite(head, 1, SLOT_BLOCK, out) != SLOT_BLOCK) break;
+		}
+		first = false;
+		if (skip)
+		{
+			skip--;
+			if (v2 && fwrite(block, 1, SLOT_BLOCK, out) != SLOT_BLOCK) break;
+			continue;
+		}
+		if (fwrite(block, 1, SLOT_BLOCK, out) != SLOT_BLOCK) break;
+		n++;
+	}
+	if (in != stdin) fclose(in);
+	if (fclose(out) || got)
+	{
+		fprintf(stderr, "qx1img: %s: %s\n", got ? from : to, got ? "not a whole number of blocks" : strerror(errno));
+		return 1;
+	}
+	if (n != FDC_IMAGE_SIZE / SLOT_BLOCK && n != FULL_SIZE / SLOT_BLOCK)
+	{
+		fprintf(stderr, "qx1img: %s is not a %d bytes image\n", from, FDC_IMAGE_SIZE);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int	i, status = 0;
+
+	if (argc == 4 && ! strcmp(argv[1], "slots")) return slots(argv[2], argv[3]);
+	if (argc == 3 && ! strcmp(argv[1], "list")) return list(argv[2]);
+	if (argc == 4 && ! strcmp(argv[1], "extract")) return extract(argv[2], argv[3]);
+	if (argc >= 3 && ! strcmp(argv[1], "crc"))
+	{
+		for (i = 2; i < argc; i++) status |= crc(argv[i]);
+		return status;
+	}
+	if (argc >= 3 && ! strcmp(argv[1], "sparse"))
+	{
+		for (i = 2; i < argc; i++) status |= sparse(argv[i]);
+		return status;
+	}
+	if (argc == 4 && ! strcmp(argv[1], "v2")) return convert(argv[2], argv[3], true);
+	if (argc == 4 && ! strcmp(argv[1], "raw")) return convert(argv[2], argv[3], false);
+	if (argc >= 3 && ! strcmp(argv[1], "verify"))
+	{
+		for (i = 2; i < argc; i++) status |= verify(argv[i]);
+		return status;
+	}
+
+	fprintf(stderr, "usage: qx1img slots <card> <dir>\n"
+			"       qx1img list <card>\n"
+			"       qx1img extract <card> <dir>\n"
+			"       qx1img crc <image>...\n"
+			"       qx1img verify <image>...\n"
+			"       qx1img sparse <image>...\n"
+			"       qx1img v2 <in> <out>\n"
+			"       qx1img raw <in> <out>\n");
+	return 2;
+}
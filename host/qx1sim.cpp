@@ -0,0 +1,640 @@
+/*
+  Yamaha QX1 floppy drive emulator - host build
+
+  Drives the MB8877 core from a simulated QX1 MPU against a disk image in a
+  host directory, and checks every byte it gets back against the image.
+  READ TRACK, READ ADDRESS, STEP IN/OUT and LOSTDATA are checked on a few
+  tracks, and STATUS must show BUSY and DRQ whenever the MPU sees a DRQ.
+  If the image has a CRC zone (qx1img crc), those tracks are also checked
+  in the background, and a wrong entry must turn into CRCERR. The sector
+  layout of the geometry is first checked on its own, both sides included.
+
+  Usage: qx1sim [-c] [-f runs] [-s card] [-t trace] [-w] <dir> <disk>
+	-c	create DISK_<disk>.QX1 in <dir> with a test pattern first,
+		its last tracks blank
+	-f	split the image in <runs> runs on the card (default 1); past
+		FDC_EXTENTS it cannot be mapped and goes through the FAT
+	-s	run from the slot card image <card> (see qx1img), checked
+		against DISK_<disk>.QX1 in <dir>
+	-t	write the trace log to <trace> as the firmware sends it on
+		the console (see qx1trace)
+	-w	also write sectors back, one and a side at a time, and read
+		them again; then format a few tracks, and write after FORCE
+		INTERRUPT
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mb8877.h"
+#include "qx1.h"
+#include "crc.h"
+#include "crczone.h"
+#include "image.h"
+#include "hal.h"
+#include "trace.h"
+#include "host.h"
+
+#define BLANK_TRACK	144			// First track of -c left blank
+
+static unsigned char	image[FDC_IMAGE_SIZE];	// Reference copy of the disk
+static unsigned char	rx[FDC_SIZE_TRACK_0 + 512];
+static unsigned long	commands, errors, fatreads;
+static bool		zone;		// The image has a CRC zone
+static long		head;		// Bytes ahead of the sector data (version 2 image)
+static FILE		*trace;		// Trace log, if asked for
+
+// Image offset of a sector, straight from the layout documented in qx1.h
+static long offset(int track, int side, int sector)
+{
+	static const int slot[FDC_SECTORS_0] = {0, 2, 4, 1, 3};
+
+	if (track < FDC_ZONE_TRACKS)
+		return track * (long)FDC_SIZE_TRACK_0 + side * FDC_SIZE_TRACK_0/2 + slot[sector % FDC_SECTORS_0] * FDC_SIZE_SECTOR_0;
+	return FDC_ZONE_TRACKS * (long)FDC_SIZE_TRACK_0 + (track - FDC_ZONE_TRACKS) * (long)FDC_SIZE_TRACK_1
+		+ side * FDC_SIZE_TRACK_1/2 + sector * FDC_SIZE_SECTOR_1;
+}
+
+// Trace records to the log, as loop() sends them to the console
+static void drain(void)
+{
+	struct trace t;
+
+	while (traceRead(&t))
+		if (trace)
+		{
+			putc(TRACE_SYNC, trace);
+			fwrite(&t, sizeof(t), 1, trace);
+		}
+}
+
+static void command(unsigned char cmd)
+{
+	commands++;
+	mpu_write(CMD, cmd);
+	fatreads += mb8877.fatreads;
+	drain();
+	if (host_writing())				// Whatever the MPU does next, or never does
+	{
+		errors++;
+		fprintf(stderr, "qx1sim: command %02x left the card in a multi-block write\n", cmd);
+	}
+}
+
+static void check(bool ok, const char *what, int track, int sector)
+{
+	if (ok) return;
+	errors++;
+	fprintf(stderr, "qx1sim: %s failed on track %d sector %d (status %02x)\n", what, track, sector, mb8877.reg[STATUS]);
+}
+
+// The layout the core is built with (sector_block() as locate() uses it,
+// sector_offset(), sector_at()) against offset(), for every track, side and
+// sector id: zone 0 numbers side 1 on from side 0 and takes either
+// numbering, ids off the side have no sector, each card block of the image
+// is in one sector, and the sectors pass under the head in the documented
+// order. Side 1 and the zone boundary never come up through the bus.
+static void layout(void)
+{
+	typedef MB8877::Geometry G;
+	static const int order[2][FDC_SECTORS_1] = {{0, 3, 1, 4, 2}, {0, 1, 2, 3, 4, 5, 6, 7, 8}};
+	static unsigned char	owner[FDC_IMAGE_SIZE / 512];
+	int	t, side, id, z, n, first, k;
+	unsigned char	b;
+	long	at;
+	bool	ok;
+
+	memset(owner, 0, sizeof(owner));
+	for (t = 0; t < FDC_TRACKS; t++)
+		for (side = 0; side < 2; side++)
+		{
+			z = t >= FDC_ZONE_TRACKS;
+			n = z ? FDC_SECTORS_1 : FDC_SECTORS_0;
+			first = z ? 0 : side * FDC_SECTORS_0;
+			check(G::zone(t) == z && G::sectors(z) == n && G::first(z, side) == first, "layout zone", t, 0);
+			for (id = 0; id < 256; id++)
+			{
+				b = G::sector_block(z, side, id);
+				if (id >= (z ? n : 2 * n))
+				{
+					check(b == GEOMETRY_NOSECTOR, "layout: no such sector", t, id);
+					continue;
+				}
+				at = offset(t, side, id);
+				ok = b != GEOMETRY_NOSECTOR && (long)(G::track_block(t) + b) * GEOMETRY_BLOCK == at
+					&& (long)G::sector_offset(G::track_sector(t) + b / G::blocks(z)) == at;
+				check(ok, side ? "layout side 1" : "layout side 0", t, id);
+				if (ok && id >= first && id < first + n)	// Documented numbering: blocks owned once
+					for (k = 0; k < G::blocks(z); k++) owner[at / 512 + k]++;
+			}
+			for (k = 0; k < n; k++)
+				check(G::sector_at(z, side, k) == first + order[z][k], "layout rotation order", t, k);
+		}
+	for (k = 0, ok = true; k < (int)sizeof(owner); k++) ok = ok && owner[k] == 1;
+	check(ok && G::image_size == FDC_IMAGE_SIZE, "layout coverage", 0, 0);
+}
+
+static void seek(int track)
+{
+	mpu_write(DATA, track);
+	command(0x10);
+	check(mpu_read(TRACK) == track, "SEEK", track, 0);
+}
+
+static void read_sector(int track, int sector)
+{
+	int	size = track < FDC_ZONE_TRACKS ? FDC_SIZE_SECTOR_0 : FDC_SIZE_SECTOR_1;
+
+	mpu_receive(rx, sizeof(rx));
+	mpu_write(SECTOR, sector);
+	command(0x80);
+	check(mpu.rxlen == (size_t)size && ! memcmp(rx, image + offset(track, 0, sector), size), "READ SECTOR", track, sector);
+}
+
+static void read_multiple(int track)
+{
+	int	size = track < FDC_ZONE_TRACKS ? FDC_SIZE_SECTOR_0 : FDC_SIZE_SECTOR_1,
+		n = track < FDC_ZONE_TRACKS ? FDC_SECTORS_0 : FDC_SECTORS_1,
+		s;
+	bool	ok;
+
+	mpu_receive(rx, sizeof(rx));
+	mpu_write(SECTOR, 0);
+	command(0x90);
+	ok = mpu.rxlen == (size_t)(n * size);
+	for (s = 0; ok && s < n; s++)
+		ok = ! memcmp(rx + s * size, image + offset(track, 0, s), size);
+	check(ok, "READ MULTIPLE SECTOR", track, 0);
+}
+
+// Next SYNC and address mark m from p on, as the controller writes them;
+// what follows the mark, NULL if none
+static const unsigned char *find_mark(const unsigned char *p, const unsigned char *end, unsigned char m)
+{
+	static const unsigned char	sync[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xa1, 0xa1, 0xa1, 0};
+
+	for (; p + 16 <= end; p++)
+		if (! memcmp(p, sync, 15) && p[15] == m) return p + 16;
+	return NULL;
+}
+
+// Index mark, then ID and data field of each sector in rotation order, with
+// their CRC, gaps of 0x4e all along, one whole MFM track
+static void read_track(int track)
+{
+	static const int order[2][FDC_SECTORS_1] = {{0, 3, 1, 4, 2}, {0, 1, 2, 3, 4, 5, 6, 7, 8}};
+	int	zone = track >= FDC_ZONE_TRACKS,
+		size = zone ? FDC_SIZE_SECTOR_1 : FDC_SIZE_SECTOR_0,
+		n = zone ? FDC_SECTORS_1 : FDC_SECTORS_0,
+		s;
+	const unsigned char	*p = rx + 96, *end = rx + GEOMETRY_TRACK_LEN, *id;
+	const unsigned char	iam[4] = {0xc2, 0xc2, 0xc2, 0xfc};
+	bool	ok;
+	CRC	crc;
+
+	mpu_receive(rx, sizeof(rx));
+	command(0xe0);
+	ok = mpu.rxlen == GEOMETRY_TRACK_LEN && rx[0] == 0x4e && rx[79] == 0x4e && ! memcmp(rx + 92, iam, 4);
+	for (s = 0; ok && s < n; s++)
+	{
+		ok = (id = find_mark(p, end, 0xfe)) && id[0] == track && id[1] == 0 && id[2] == order[zone][s]
+			&& id[3] == (zone ? 2 : 3) && (p = find_mark(id, end, 0xfb)) && p + size + 2 <= end;
+		if (! ok) break;
+		crc.reset();
+		crc.compute(id - 4, 8);
+		ok = id[4] == crc.msb() && id[5] == crc.lsb();
+		crc.reset();
+		crc.compute(p - 4, size + 4);
+		ok = ok && ! memcmp(p, image + offset(track, 0, order[zone][s]), size) && p[size] == crc.msb() && p[size+1] == crc.lsb();
+		p += size + 2;
+	}
+	while (ok && p < end) ok = *p++ == 0x4e;
+	check(ok, "READ TRACK", track, 0);
+}
+
+static void read_address(int track)
+{
+	CRC	crc;
+
+	mpu_receive(rx, sizeof(rx));
+	mpu_write(SECTOR, 1);
+	command(0xc0);
+	crc.compute(0xa1);
+	crc.compute(0xa1);
+	crc.compute(0xa1);
+	crc.compute(0xfe);
+	crc.compute(rx, 4);
+	check(mpu.rxlen == 6 && rx[0] == track && rx[2] == 1 && rx[3] == (track < FDC_ZONE_TRACKS ? 3 : 2)
+		&& rx[4] == crc.msb() && rx[5] == crc.lsb(), "READ ADDRESS", track, 1);
+}
+
+// STEP IN then STEP OUT, both updating the track register
+static void step(int track)
+{
+	command(0x50);
+	check(mpu_read(TRACK) == (track < FDC_TRACKS - 1 ? track + 1 : track), "STEP IN", track, 0);
+	command(0x70);
+	check(mpu_read(TRACK) == track, "STEP OUT", track, 0);
+}
+
+// The MPU stops answering DRQ halfway: LOSTDATA, and the command ends
+static void lose_data(int track)
+{
+	mpu_receive(rx, 100);
+	mpu_write(SECTOR, 0);
+	command(0x80);
+	check(mpu.rxlen == 100 && (mb8877.reg[STATUS] & FDC_ST_LOSTDATA) && ! (mb8877.reg[STATUS] & FDC_ST_BUSY),
+		"LOST DATA", track, 0);
+}
+
+static void write_sector(int track, int sector, const unsigned char *data)
+{
+	int	size = track < FDC_ZONE_TRACKS ? FDC_SIZE_SECTOR_0 : FDC_SIZE_SECTOR_1;
+
+	mpu_send(data, size);
+	mpu_write(SECTOR, sector);
+	command(0xa0);
+	check(mpu.txpos == (size_t)size && ! (mb8877.reg[STATUS] & FDC_ST_LOSTDATA), "WRITE SECTOR", track, sector);
+}
+
+// WRITE MULTIPLE SECTOR over side 0 of the track, each byte of the image
+// inverted, then READ MULTIPLE SECTOR; twice, so the image is as it was
+static void write_multiple(int track)
+{
+	static unsigned char	data[FDC_SIZE_TRACK_0 / 2];
+	int	size = track < FDC_ZONE_TRACKS ? FDC_SIZE_SECTOR_0 : FDC_SIZE_SECTOR_1,
+		n = track < FDC_ZONE_TRACKS ? FDC_SECTORS_0 : FDC_SECTORS_1,
+		i, s, k;
+
+	for (k = 0; k < 2; k++)
+	{
+		for (s = 0; s < n; s++)
+			for (i = 0; i < size; i++) data[s * size + i] = ~image[offset(track, 0, s) + i];
+		mpu_send(data, n * size);
+		mpu_write(SECTOR, 0);
+		command(0xb0);
+		check(mpu.txpos == (size_t)(n * size) && ! (mb8877.reg[STATUS] & (FDC_ST_LOSTDATA|FDC_ST_WRITEFAULT)),
+			"WRITE MULTIPLE SECTOR", track, 0);
+		for (s = 0; s < n; s++) memcpy(image + offset(track, 0, s), data + s * size, size);
+		read_multiple(track);
+	}
+}
+
+// The sector as the card holds it, read behind the emulator's back: a
+// write the MPU was told is done must be there, whatever comes after it
+static void on_card(const char *path, int track, int sector)
+{
+	int	size = track < FDC_ZONE_TRACKS ? FDC_SIZE_SECTOR_0 : FDC_SIZE_SECTOR_1;
+	unsigned char	buf[FDC_SIZE_SECTOR_0];
+	FILE	*f = fopen(path, "rb");
+	bool	ok = f && ! fseek(f, head + offset(track, 0, sector), SEEK_SET)
+		&& fread(buf, 1, size, f) == (size_t)size && ! memcmp(buf, image + offset(track, 0, sector), size);
+
+	if (f) fclose(f);
+	check(ok, "card contents", track, sector);
+}
+
+// WRITE MULTIPLE SECTOR over a zone 1 side that the MPU gives up on early in
+// sector 3: LOSTDATA, sectors 0-2 written, and the card still holds the
+// others as they were, none of them pre-erased and left so; twice, so the
+// image is as it was
+static void abort_multiple(const char *path, int track)
+{
+	static unsigned char	data[3 * FDC_SIZE_SECTOR_1 + 100];
+	int	size = FDC_SIZE_SECTOR_1, i, s, k;
+
+	for (k = 0; k < 2; k++)
+	{
+		for (i = 0; i < (int)sizeof(data); i++) data[i] = ~image[offset(track, 0, i / size) + i % size];
+		mpu_send(data, sizeof(data));
+		mpu_write(SECTOR, 0);
+		command(0xb0);
+		check(mpu.txpos == sizeof(data) && (mb8877.reg[STATUS] & FDC_ST_LOSTDATA),
+			"WRITE MULTIPLE SECTOR cut short", track, 3);
+		for (s = 0; s < 3; s++) memcpy(image + offset(track, 0, s), data + s * size, size);
+		for (s = 0; ! host_card && s < FDC_SECTORS_1; s++) on_card(path, track, s);
+		read_multiple(track);
+	}
+}
+
+// Idle time for the background CRC check of the track, or the read-ahead
+static void idle(void)
+{
+	int	i;
+
+	for (i = 0; i < 64; i++) mb8877.step();
+}
+
+// FORCE INTERRUPT keeps the disk: sector 2 written straight after it, no
+// RESTORE in between, is on the card, and once the disk is opened again
+// reads back with its CRC right (zone updated) and not as the fill byte of
+// a sparse image (its bit set); then the sector as it was, the same way
+static void write_after_interrupt(const char *path, int track)
+{
+	unsigned char	data[FDC_SIZE_SECTOR_0];
+	int	size = track < FDC_ZONE_TRACKS ? FDC_SIZE_SECTOR_0 : FDC_SIZE_SECTOR_1, i, k;
+
+	for (k = 0; k < 2; k++)
+	{
+		seek(track);
+		command(0xd0);
+		for (i = 0; i < size; i++) data[i] = ~image[offset(track, 0, 2) + i];
+		write_sector(track, 2, data);
+		memcpy(image + offset(track, 0, 2), data, size);
+		if (! host_card) on_card(path, track, 2);
+		command(0x00);
+		seek(track);
+		idle();					// The background check of the sector
+		read_sector(track, 2);
+		check(! (mb8877.reg[STATUS] & FDC_ST_CRCERR), "CRC after FORCE INTERRUPT", track, 2);
+	}
+}
+
+// Side 0 of the track as the QX1 formats it, the MB8877 codes for sync
+// bytes and CRCs included. The data fields start with blank bytes 0xe5, the
+// rest of each one mixed; odd sectors have the deleted data mark 0xf8.
+// With bad, the ID fields name another track.
+static void build_track(unsigned char *tx, int track, int blank, bool bad)
+{
+	static const int order[2][FDC_SECTORS_1] = {{0, 3, 1, 4, 2}, {0, 1, 2, 3, 4, 5, 6, 7, 8}};
+	int	zone = track >= FDC_ZONE_TRACKS,
+		size = zone ? FDC_SIZE_SECTOR_1 : FDC_SIZE_SECTOR_0,
+		n = zone ? FDC_SECTORS_1 : FDC_SECTORS_0,
+		gap3 = MB8877::Geometry::gap3(zone),
+		i, s;
+	unsigned char	*p = tx;
+
+	memset(tx, 0x4e, GEOMETRY_TRACK_LEN);
+	p += 80;
+	memset(p, 0x00, 12); p += 12;
+	memset(p, 0xf6, 3); p += 3;
+	*p++ = 0xfc;
+	p += 50;
+	for (s = 0; s < n; s++, p += gap3)
+	{
+		memset(p, 0x00, 12); p += 12;
+		memset(p, 0xf5, 3); p += 3;
+		*p++ = 0xfe;
+		*p++ = bad ? track + 1 : track;
+		*p++ = 0;
+		*p++ = order[zone][s];
+		*p++ = zone ? 2 : 3;
+		*p++ = 0xf7;
+		p += 22;
+		memset(p, 0x00, 12); p += 12;
+		memset(p, 0xf5, 3); p += 3;
+		*p++ = order[zone][s] & 1 ? 0xf8 : 0xfb;
+		for (i = 0; i < size; i++) *p++ = i < blank ? 0xe5 : (i * 3 + s) & 0x7f;
+		*p++ = 0xf7;
+	}
+}
+
+// The first sectors of the track in rotation order, as build_track() has
+// them, to the reference copy
+static void formatted(const unsigned char *tx, int track, int sectors)
+{
+	static const int order[2][FDC_SECTORS_1] = {{0, 3, 1, 4, 2}, {0, 1, 2, 3, 4, 5, 6, 7, 8}};
+	int	zone = track >= FDC_ZONE_TRACKS,
+		size = zone ? FDC_SIZE_SECTOR_1 : FDC_SIZE_SECTOR_0,
+		gap3 = MB8877::Geometry::gap3(zone),
+		s;
+	const unsigned char	*p = tx + 146;
+
+	for (s = 0; s < sectors; s++, p += gap3)
+	{
+		p += 12 + 4 + 5 + 22 + 12 + 4;
+		memcpy(image + offset(track, 0, order[zone][s]), p, size);
+		p += size + 1;
+	}
+}
+
+// WRITE TRACK of side 0 (see build_track()), then READ MULTIPLE SECTOR and
+// READ TRACK; the 0xf8 marks read back as 0xfb. With bad: WRITEFAULT, and
+// the sectors stay as they were.
+static void format(int track, int blank, bool bad)
+{
+	static unsigned char	tx[GEOMETRY_TRACK_LEN];
+
+	build_track(tx, track, blank, bad);
+	mpu_send(tx, sizeof(tx));
+	command(0xf0);
+	check(mpu.txpos == sizeof(tx) && ! (mb8877.reg[STATUS] & FDC_ST_LOSTDATA)
+		&& ! (mb8877.reg[STATUS] & FDC_ST_WRITEFAULT) == ! bad, "WRITE TRACK", track, 0);
+
+	if (! bad) formatted(tx, track, track < FDC_ZONE_TRACKS ? FDC_SECTORS_0 : FDC_SECTORS_1);
+	idle();						// The background check of what was formatted
+	read_multiple(track);
+	read_track(track);
+}
+
+// WRITE TRACK cut by FORCE INTERRUPT halfway, between the ID field of the
+// fourth sector and its data field: the side is left unformatted
+// (WRITEFAULT), the three sectors before it are on the card with their CRC,
+// and the others are as they were, sector bits of a sparse image included.
+// More than the FIFO holds comes after the third data field, so all of it
+// has reached the core when the command is cut.
+static void abort_format(int track)
+{
+	static unsigned char	tx[GEOMETRY_TRACK_LEN];
+	int	zone = track >= FDC_ZONE_TRACKS,
+		size = zone ? FDC_SIZE_SECTOR_1 : FDC_SIZE_SECTOR_0;
+	size_t	cut = 146 + 3 * (61 + size + MB8877::Geometry::gap3(zone)) + 44;
+
+	build_track(tx, track, 0, false);
+	mpu_send(tx, sizeof(tx));
+	mpu.cut = cut;
+	command(0xf0);
+	check(mpu.txpos == cut && ! (mb8877.reg[STATUS] & FDC_ST_LOSTDATA) && (mb8877.reg[STATUS] & FDC_ST_WRITEFAULT),
+		"WRITE TRACK cut short", track, 3);
+	formatted(tx, track, 3);
+	idle();
+	read_multiple(track);
+	command(0x00);					// The sector bits as the header has them
+	seek(track);
+	read_multiple(track);
+}
+
+// A wrong CRC zone entry for sector 1 of the track, written behind the
+// emulator's back: once checked, reading the sector ends with CRCERR
+static void bad_crc(const char *path, int track)
+{
+	int	size = track < FDC_ZONE_TRACKS ? FDC_SIZE_SECTOR_0 : FDC_SIZE_SECTOR_1;
+	long	at = head + FDC_IMAGE_SIZE + CRCZONE_HEAD	// Sector 0 starts the track in the image
+		+ 2 * (MB8877::Geometry::track_sector(track) + (offset(track, 0, 1) - offset(track, 0, 0)) / size);
+	unsigned char	entry[2];
+	FILE	*f = fopen(path, "r+b");
+
+	if (! f || fseek(f, at, SEEK_SET) || fread(entry, 1, 2, f) != 2)
+	{
+		check(false, "CRC zone access", track, 1);
+		if (f) fclose(f);
+		return;
+	}
+	entry[0] ^= 0xff;
+	fseek(f, at, SEEK_SET);
+	fwrite(entry, 1, 2, f);
+	fflush(f);
+
+	command(0x00);					// RESTORE reads the zone again
+	seek(track);
+	idle();
+	read_sector(track, 1);
+	check(mb8877.reg[STATUS] & FDC_ST_CRCERR, "CRC check", track, 1);
+	read_sector(track, 0);
+	check(! (mb8877.reg[STATUS] & FDC_ST_CRCERR), "CRC check", track, 0);
+
+	entry[0] ^= 0xff;
+	fseek(f, at, SEEK_SET);
+	fwrite(entry, 1, 2, f);
+	fclose(f);
+	command(0x00);
+}
+
+// Bytes ahead of the sector data of an image: its header if version 2
+static long header(FILE *f)
+{
+	struct qx1image h;
+
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, IMAGE_MAGIC, sizeof(h.magic))
+	 || h.version != IMAGE_VERSION) return 0;
+	return h.head * 512L;
+}
+
+static bool create(const char *path)
+{
+	FILE	*f = fopen(path, "wb");
+	unsigned long i;
+
+	if (! f) return false;
+	for (i = 0; i < FDC_IMAGE_SIZE; i++)		// The last tracks blank, as on a disk not full
+		image[i] = i < (unsigned long)offset(BLANK_TRACK, 0, 0) ? (i * 7 + (i >> 9) * 13) & 0xff : 0xe5;
+	fwrite(image, 1, FDC_IMAGE_SIZE, f);
+	return fclose(f) == 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char	data[FDC_SIZE_SECTOR_0];
+	char	path[1024];
+	bool	make = false, writes = false;
+	int	c, n, t, s, i;
+	FILE	*f;
+
+	while ((c = getopt(argc, argv, "cf:s:t:w")) != -1)
+		switch (c)
+		{
+			case 'c': make = true; break;
+			case 'f': host_runs = atoi(optarg); break;
+			case 's': host_card = optarg; break;
+			case 't':
+				if (! (trace = fopen(optarg, "wb")))
+				{
+					perror(optarg);
+					return 1;
+				}
+				break;
+			case 'w': writes = true; break;
+			default: return 2;
+		}
+	if (argc - optind != 2)
+	{
+		fprintf(stderr, "usage: qx1sim [-c] [-f runs] [-s card] [-t trace] [-w] <dir> <disk>\n");
+		return 2;
+	}
+	host_dir = argv[optind];
+	n = atoi(argv[optind + 1]);
+	snprintf(path, sizeof(path), "%s/DISK_%03d.QX1", host_dir, n);
+
+	layout();
+	if (make && ! create(path))
+	{
+		perror(path);
+		return 1;
+	}
+	if ((f = fopen(path, "rb"))) head = header(f);
+	if (! f || fseek(f, head, SEEK_SET) || fread(image, 1, FDC_IMAGE_SIZE, f) != FDC_IMAGE_SIZE)
+	{
+		fprintf(stderr, "qx1sim: cannot read %s\n", path);
+		return 1;
+	}
+	zone = fseek(f, 0, SEEK_END) == 0 && ftell(f) > head + FDC_IMAGE_SIZE;
+	fclose(f);
+
+	if (trace) fprintf(trace, "qx1sim: DISK_%03d.QX1\n", n);	// Console text between records
+	begin_qx1();
+	scanSD();
+	mb8877.insert(n);
+	command(0x00);					// RESTORE opens the disk
+	check(mpu_read(TRACK) == 0, "RESTORE", 0, 0);
+
+	for (t = 0; t < FDC_TRACKS; t++)
+	{
+		seek(t);
+		idle();					// The MPU is slower than that: read-ahead
+		for (s = 0; s < (t < FDC_ZONE_TRACKS ? FDC_SECTORS_0 : FDC_SECTORS_1); s++)
+			read_sector(t, s);
+		read_multiple(t);
+		if (t % 16 == 0 || t == FDC_ZONE_TRACKS)
+		{
+			if (zone) idle();		// READ TRACK then sends the stored CRCs
+			read_track(t);
+			read_address(t);
+			step(t);
+		}
+	}
+	lose_data(FDC_TRACKS - 1);
+	if (zone && ! host_card)
+	{
+		bad_crc(path, 3);
+		bad_crc(path, FDC_ZONE_TRACKS + 1);
+	}
+
+	if (writes)
+		for (t = 0; t < FDC_TRACKS; t += 37)
+		{
+			seek(t);
+			s = t < FDC_ZONE_TRACKS ? FDC_SECTORS_0 - 1 : FDC_SECTORS_1 - 1;
+			c = t < FDC_ZONE_TRACKS ? FDC_SIZE_SECTOR_0 : FDC_SIZE_SECTOR_1;
+			for (i = 0; i < c; i++) data[i] = ~image[offset(t, 0, s) + i];
+			write_sector(t, s, data);
+			memcpy(image + offset(t, 0, s), data, c);
+			idle();
+			if (! host_card) on_card(path, t, s);	// Not left in the buffer until the next seek
+			read_sector(t, s);
+			for (i = 0; i < c; i++) data[i] = ~data[i];
+			write_sector(t, s, data);		// Put the original back
+			memcpy(image + offset(t, 0, s), data, c);
+			write_multiple(t);
+			for (i = 0; ! host_card && i <= s; i++) on_card(path, t, i);
+			if (t >= FDC_ZONE_TRACKS) abort_multiple(path, t);
+			command(0xd0);				// FORCE INTERRUPT, the disk kept
+			command(0x00);				// RESTORE opens it again
+		}
+
+	if (writes)
+	{
+		for (i = 0; i < 3; i++)				// Zone 0, zone 1, blank track
+		{
+			t = i == 0 ? 5 : i == 1 ? FDC_ZONE_TRACKS + 20 : BLANK_TRACK + 4;
+			seek(t);
+			format(t, 0, false);			// Other data than before, other CRCs
+			format(t, t < FDC_ZONE_TRACKS ? 700 : FDC_SIZE_SECTOR_1, false);	// Blank: no card write if sparse
+			abort_format(t);
+		}
+		format(t, 0, true);
+		command(0xd0);
+		write_after_interrupt(path, BLANK_TRACK + 8);	// Blank: its bit clear on a sparse image
+	}
+
+	check(mpu.stale == 0, "DRQ STATUS", 0, 0);
+	check(mb8877.stats.lostdata == (writes ? 5U : 1U) && mb8877.stats.crcerr == (zone && ! host_card ? 2U : 0U)
+		&& mb8877.stats.writefault == (writes ? 1U : 0U) && ! mb8877.stats.retries, "error counters", 0, 0);
+	drain();
+	if (trace && fclose(trace)) perror("qx1sim: trace");
+	printf("qx1sim: %lu commands, %lu DRQ, %u FIFO underruns, %lu FAT reads, %u blank sectors, "
+		"read-ahead %u hits %u misses, %lu errors\n", commands, mpu.drq, mb8877.stats.underruns, fatreads,
+		mb8877.stats.blank, mb8877.stats.hits, mb8877.stats.misses, errors);
+	return errors != 0;
+}
@@ -0,0 +1,108 @@
+/*
+  Yamaha QX1 floppy drive emulator - host build
+
+  Decoder of the trace log (see qx1/trace.h): reads what the firmware sent
+  on the serial console, or what qx1sim -t wrote, passes the console text
+  through and prints each trace record on a line of its own, with the time
+  since the first record and the duration of each command.
+
+  Usage: qx1trace [file]	(standard input if none), e.g.
+	stty -F /dev/ttyUSB0 9600 raw && qx1trace /dev/ttyUSB0
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mb8877.h"
+#include "trace.h"
+
+static const char *commands[16] = {
+	"RESTORE", "SEEK", "STEP", "STEP", "STEP IN", "STEP IN", "STEP OUT", "STEP OUT",
+	"READ SECTOR", "READ MULTIPLE", "WRITE SECTOR", "WRITE MULTIPLE",
+	"READ ADDRESS", "FORCE INT", "READ TRACK", "WRITE TRACK"
+};
+
+// Status bits from bit 7 down, as type I and as type II/III commands read them
+static const char *status_1[8] = { "NOTREADY", "WRPROT", "HEADENG", "SEEKERR", "CRCERR", "TRACK00", "INDEX", "BUSY" };
+static const char *status_2[8] = { "NOTREADY", "WRPROT", "WRFAULT", "RECNFND", "CRCERR", "LOSTDATA", "DRQ", "BUSY" };
+
+static const char *flags(unsigned char cmd, unsigned char status)
+{
+	static char	buf[80];
+	const char	**names = cmd < 0x80 || (cmd & 0xf0) == 0xd0 ? status_1 : status_2;
+	int	i;
+
+	buf[0] = 0;
+	for (i = 0; i < 8; i++)
+		if (status & (0x80 >> i))
+		{
+			strcat(buf, " ");
+			strcat(buf, names[i]);
+		}
+	return buf;
+}
+
+int main(int argc, char **argv)
+{
+	FILE	*in = stdin;
+	struct trace t;
+	unsigned long long now = 0;	// us since the first record
+	unsigned long long start = 0;	// Of the command in progress
+	uint32_t	last = 0;
+	bool	first = true, line = false;
+	int	c;
+
+	if (argc > 2 || (argc == 2 && ! (in = fopen(argv[1], "rb"))))
+	{
+		if (argc == 2) perror(argv[1]);
+		else fprintf(stderr, "usage: qx1trace [file]\n");
+		return argc == 2 ? 1 : 2;
+	}
+
+	while ((c = getc(in)) != EOF)
+	{
+		if (c != TRACE_SYNC)			// Console text
+		{
+			putchar(c);
+			line = c != '\n';
+			continue;
+		}
+		if (fread(&t, sizeof(t), 1, in) != 1) break;
+		if (line) putchar('\n');
+		line = false;
+
+		now += first ? 0 : (uint32_t)(t.time - last);
+		last = t.time;
+		first = false;
+		printf("%12.3f ms  ", now * 0.001);
+
+		switch (t.kind)
+		{
+			case TRACE_CMD:
+				start = now;
+				printf("CMD   %02x %-14s track %3d sector %2d data %02x\n",
+					t.cmd, commands[t.cmd >> 4], t.track, t.sector, t.data);
+				break;
+			case TRACE_END:
+				printf("END   %02x %-14s track %3d sector %2d status %02x%s, %.3f ms\n",
+					t.cmd, commands[t.cmd >> 4], t.track, t.sector, t.status,
+					flags(t.cmd, t.status), (now - start) * 0.001);
+				break;
+			case TRACE_LOST:
+				printf("LOST  %02x %-14s track %3d sector %2d after %d bytes (low byte)\n",
+					t.cmd, commands[t.cmd >> 4], t.track, t.sector, t.data);
+				break;
+			case TRACE_INSERT:
+				if (t.data == 0xff) printf("DISK  none\n");
+				else printf("DISK  %03d\n", t.data);
+				break;
+			case TRACE_DROP:
+				printf("DROP  %d%s records lost\n", t.data, t.data == 255 ? " or more" : "");
+				break;
+			default:
+				printf("?     kind %d\n", t.kind);
+		}
+	}
+	if (line) putchar('\n');
+	return 0;
+}
@@ -0,0 +1,45 @@
+#!/bin/sh
+# RAM budget of the firmware, from the ELF the Arduino build leaves behind
+# (e.g. /tmp/arduino_build_*/qx1.ino.elf): .data and .bss against the 2048
+# bytes of the ATmega328, the largest variables, and with -fstack-usage the
+# largest frames. What is left is the stack; fails if that is under
+# STACK bytes. The deepest stack reached is measured on the board: 'm' on
+# the console (see ram_paint in qx1/hal_avr.cpp).
+#
+# Usage: ramreport.sh <elf> [build dir]	CROSS=avr- (default), RAM=2048, STACK=256
+
+CROSS=${CROSS-avr-}
+RAM=${RAM:-2048}
+STACK=${STACK:-256}
+
+if [ $# -lt 1 ] || [ ! -f "$1" ]; then
+	echo "usage: ramreport.sh <elf> [build dir]" >&2
+	exit 2
+fi
+
+set -- "$1" "${2:-$(dirname "$1")}"
+data=$(${CROSS}size -A "$1" | awk '$1 == ".data" { print $2 }')
+bss=$(${CROSS}size -A "$1" | awk '$1 == ".bss" { print $2 }')
+data=${data:-0}
+bss=${bss:-0}
+left=$((RAM - data - bss))
+
+echo ".data $data .bss $bss: $left of $RAM bytes left for the stack"
+echo
+echo "Largest variables:"
+${CROSS}nm -S --size-sort -C "$1" | awk '$3 ~ /^[bBdD]$/' | tail -n 10 | \
+	while read addr size type name; do printf "%6d  %s\n" 0x$size "$name"; done | sort -n -r
+
+if ls "$2"/*.su >/dev/null 2>&1 || ls "$2"/*/*.su >/dev/null 2>&1; then
+	echo
+	echo "Largest stack frames:"
+	cat "$2"/*.su "$2"/*/*.su 2>/dev/null | sort -t '	' -k 2 -n -r | head -n 10 | \
+		sed 's/ \[with [^]]*\]//' | awk -F '\t' '{ printf "%6d  %s (%s)\n", $2, $1, $3 }'
+fi
+
+if [ $left -lt $STACK ]; then
+	echo
+	echo "ramreport: $left bytes left, under the $STACK bytes stack budget" >&2
+	exit 1
+fi
+exit 0
@@ -0,0 +1,32 @@
+/*
+  Yamaha QX1 floppy drive emulator
+
+  Francois Basquin, 2014 mar 20
+
+  CRC zone. An image may carry, right after its data (from byte image_size
+  of its geometry, a card block boundary), the CRC of the data field of
+  every sector: what the disk would hold after each sector. The emulator
+  serves them as they are (READ TRACK), checks the sectors against them
+  when it has nothing else to do, and rewrites the entry of each sector
+  written. host/qx1img builds and checks the zone of an image.
+
+  A struct crczone, then one entry per sector in image order: CCITT-CRC16
+  of A1 A1 A1 FB and the sector data, most significant byte first. The zone
+  takes whole card blocks; an image without it works as before.
+*/
+
+#ifndef _H_CRCZONE
+#define _H_CRCZONE
+
+#include <stdint.h>
+
+#define CRCZONE_MAGIC	"QX1CRC"	// 6 bytes, no terminating zero
+#define CRCZONE_HEAD	8		// Bytes before the first entry
+#define CRCZONE_BLOCKS(sectors)	((CRCZONE_HEAD + 2UL * (sectors) + 511) / 512)
+
+struct crczone {
+	char	magic[6];		// CRCZONE_MAGIC
+	uint16_t sectors;		// Entries: sector_count of the geometry (little endian)
+};
+
+#endif
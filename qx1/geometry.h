@@ -0,0 +1,156 @@
+/*
+  Yamaha QX1 floppy drive emulator
+
+  Francois Basquin, 2014 mar 20
+
+  Disk geometries. The MB8877 core is a template on one of them (see
+  mb8877.h): a type made of compile time constants only, so whatever the
+  core computes from the geometry folds into constants, and a layout with
+  a single zone or no interleave loses those tests altogether.
+
+  A geometry is one or two zones of tracks, each with its own sector layout.
+  The image holds the tracks in order; each track holds side 0 then side 1,
+  and each side its sectors in the order they pass under the head. Sector
+  sizes are multiples of 512 bytes, so every sector starts on a card block.
+*/
+
+#ifndef _H_GEOMETRY
+#define _H_GEOMETRY
+
+#include <stdint.h>
+
+#include "qx1.h"
+
+#define GEOMETRY_BLOCK		512	// Card block: unit of the image layout
+#define GEOMETRY_NOSECTOR	0xff	// Sector id not on the track
+
+// MFM track as READ TRACK sends it (see track_template in mb8877.cpp)
+#define GEOMETRY_TRACK_LEN	6250	// Bytes between index pulses: 250 kbit/s at 300 rpm
+#define GEOMETRY_TRACK_HEAD	146	// GAP 0, SYNC, index mark, GAP 1
+#define GEOMETRY_SECTOR_FRAME	62	// SYNC, ID mark, ID, CRC, GAP 2, SYNC, data mark, CRC
+#define GEOMETRY_GAP4_MIN	16	// Least GAP 4 before the index
+
+// Compile time arithmetic, C++11 style
+static constexpr uint8_t geometry_mod(unsigned int a, uint8_t n) { return a < n ? a : geometry_mod(a - n, n); }
+static constexpr uint8_t geometry_log2(unsigned int n) { return n > 1 ? 1 + geometry_log2(n / 2) : 0; }
+static constexpr uint8_t geometry_inverse(uint8_t a, uint8_t n, uint8_t k = 1) {	// k with a * k = 1 (mod n)
+	return k >= n || geometry_mod(a * k, n) == 1 % n ? geometry_mod(k, n) : geometry_inverse(a, n, k + 1);
+}
+
+// Tracks sharing one sector layout.
+//	TRACKS	tracks in the zone
+//	SECTORS	sectors per side
+//	SIZE	bytes per sector
+//	SKEW	interleave: sector k of a side passes k * SKEW (mod SECTORS) slots
+//		after the first one
+//	FIRST	id of the first sector
+//	SIDED	side 1 numbers its sectors after those of side 0
+template <uint8_t TRACKS, uint8_t SECTORS, uint16_t SIZE, uint8_t SKEW = 1, uint8_t FIRST = 0, bool SIDED = false>
+struct Zone {
+	static_assert(! (SIZE % GEOMETRY_BLOCK) && SIZE >= GEOMETRY_BLOCK, "sectors must be whole card blocks");
+	static_assert(SECTORS && SECTORS <= 16 && SKEW && (SECTORS == 1 || SKEW < SECTORS), "bad sector layout");
+	static_assert(SECTORS == 1 || geometry_mod(SKEW * geometry_inverse(SKEW, SECTORS), SECTORS) == 1,
+		"SKEW skips sectors");
+
+	static constexpr uint8_t	tracks = TRACKS, sectors = SECTORS, skew = SKEW, first = FIRST,
+					unskew = geometry_inverse(SKEW, SECTORS),	// Slot p holds sector p * unskew
+					blocks = SIZE / GEOMETRY_BLOCK,			// Card blocks per sector
+					code = geometry_log2(SIZE / 128);		// ID size code: 128 << code bytes
+	static constexpr uint16_t	size = SIZE;
+	static constexpr bool		sided = SIDED;
+
+	// GAP 3 as long as the track allows (up to 255), GAP 4 the rest of it
+	static constexpr uint16_t	frames = GEOMETRY_TRACK_LEN - GEOMETRY_TRACK_HEAD - GEOMETRY_GAP4_MIN,
+					gap3_fit = frames / SECTORS > SIZE + GEOMETRY_SECTOR_FRAME
+						? frames / SECTORS - SIZE - GEOMETRY_SECTOR_FRAME : 0;
+	static constexpr uint8_t	gap3 = gap3_fit > 255 ? 255 : gap3_fit;
+	static constexpr uint16_t	gap4 = GEOMETRY_TRACK_LEN - GEOMETRY_TRACK_HEAD
+						- SECTORS * (SIZE + GEOMETRY_SECTOR_FRAME + gap3);
+	static_assert(! TRACKS || (unsigned long)SECTORS * (SIZE + GEOMETRY_SECTOR_FRAME) + GEOMETRY_TRACK_HEAD
+		+ GEOMETRY_GAP4_MIN <= GEOMETRY_TRACK_LEN, "sectors do not fit on an MFM track");
+};
+
+// Up to two zones (the second one with no tracks if there is none) on SIDES
+// sides. Everything is constexpr; given a track, side or sector known at run
+// time only, a function costs a few compares and small multiplies.
+template <uint8_t SIDES, class Z0, class Z1 = Zone<0, 1, GEOMETRY_BLOCK> >
+struct Geometry {
+	static constexpr uint8_t	sides = SIDES,
+					tracks = Z0::tracks + Z1::tracks,
+					zones = Z1::tracks ? 2 : 1,
+					max_sectors = Z0::sectors > Z1::sectors ? Z0::sectors : Z1::sectors;
+	static constexpr unsigned long	image_size = (unsigned long)SIDES * GEOMETRY_BLOCK
+		* (Z0::tracks * Z0::sectors * Z0::blocks + Z1::tracks * Z1::sectors * Z1::blocks);
+	static constexpr unsigned int	sector_count = SIDES * (Z0::tracks * Z0::sectors + Z1::tracks * Z1::sectors);
+
+	// Zone of track t (0 or 1)
+	static constexpr uint8_t zone(uint8_t t) { return zones > 1 && t >= Z0::tracks; }
+
+	static constexpr uint8_t sectors(uint8_t z) { return z ? Z1::sectors : Z0::sectors; }
+	static constexpr uint16_t size(uint8_t z) { return z ? Z1::size : Z0::size; }
+	static constexpr uint8_t blocks(uint8_t z) { return z ? Z1::blocks : Z0::blocks; }
+	static constexpr uint8_t code(uint8_t z) { return z ? Z1::code : Z0::code; }
+	static constexpr uint8_t gap3(uint8_t z) { return z ? Z1::gap3 : Z0::gap3; }
+	static constexpr uint16_t gap4(uint8_t z) { return z ? Z1::gap4 : Z0::gap4; }
+
+	// Id of the first sector of a side
+	static constexpr uint8_t first(uint8_t z, uint8_t side) {
+		return z ? Z1::first + (Z1::sided ? side * Z1::sectors : 0) : Z0::first + (Z0::sided ? side * Z0::sectors : 0);
+	}
+
+	// Card blocks of a track, and from the start of the image to track t
+	static constexpr uint16_t track_blocks(uint8_t z) {
+		return SIDES * (z ? Z1::sectors * Z1::blocks : Z0::sectors * Z0::blocks);
+	}
+	static constexpr uint16_t track_block(uint8_t t) {
+		return zone(t) ? Z0::tracks * track_blocks(0) + (t - Z0::tracks) * track_blocks(1) : t * track_blocks(0);
+	}
+
+	// Sectors of the image before track t, and image offset of the sector
+	// at index i in image order
+	static constexpr unsigned int track_sector(uint8_t t) {
+		return SIDES * (zone(t) ? Z0::tracks * Z0::sectors + (t - Z0::tracks) * Z1::sectors : t * Z0::sectors);
+	}
+	static constexpr unsigned long sector_offset(unsigned int i) {
+		return (unsigned long)GEOMETRY_BLOCK * (i < track_sector(Z0::tracks) ? i * Z0::blocks
+			: (unsigned long)track_sector(Z0::tracks) * Z0::blocks + (i - track_sector(Z0::tracks)) * Z1::blocks);
+	}
+
+	// Card block of sector id within its track, GEOMETRY_NOSECTOR if the
+	// side has no such sector. A SIDED zone accepts either numbering.
+	static constexpr uint8_t sector_block(uint8_t z, uint8_t side, uint8_t id) {
+		return z ? block<Z1>(side, id) : block<Z0>(side, id);
+	}
+
+	// Id of the sector passing at slot p of a side
+	static constexpr uint8_t sector_at(uint8_t z, uint8_t side, uint8_t p) {
+		return first(z, side) + (z ? geometry_mod(p * Z1::unskew, Z1::sectors) : geometry_mod(p * Z0::unskew, Z0::sectors));
+	}
+
+private:
+	template <class Z> static constexpr uint8_t block(uint8_t side, uint8_t id) {
+		return side >= SIDES || id < Z::first || id - Z::first >= (Z::sided ? SIDES : 1) * Z::sectors
+			? GEOMETRY_NOSECTOR
+			: (side * Z::sectors + geometry_mod(geometry_mod(id - Z::first, Z::sectors) * Z::skew, Z::sectors)) * Z::blocks;
+	}
+};
+
+// ----------------------------------------------------------------------------
+// Yamaha QX1 (see qx1.h): 2 x 160 tracks; zone 0 with 5 sectors of 1024
+// bytes, interleaved, numbered 0-4 on side 0 and 5-9 on side 1; zone 1 with
+// 9 sectors of 512 bytes, in order, numbered 0-8 on both sides
+// ----------------------------------------------------------------------------
+typedef Geometry<2,
+	Zone<FDC_ZONE_TRACKS, FDC_SECTORS_0, FDC_SIZE_SECTOR_0, 2, 0, true>,
+	Zone<FDC_TRACKS - FDC_ZONE_TRACKS, FDC_SECTORS_1, FDC_SIZE_SECTOR_1> > QX1Geometry;
+
+static_assert(QX1Geometry::image_size == FDC_IMAGE_SIZE, "QX1 geometry does not cover the image");
+static_assert(QX1Geometry::track_blocks(0) * GEOMETRY_BLOCK == FDC_SIZE_TRACK_0
+	&& QX1Geometry::track_blocks(1) * GEOMETRY_BLOCK == FDC_SIZE_TRACK_1, "QX1 geometry does not match qx1.h");
+
+// The geometry the core is built for; other MB8877 based gear defines its own
+#ifndef FDC_GEOMETRY
+#define FDC_GEOMETRY	QX1Geometry
+#endif
+
+#endif
@@ -0,0 +1,64 @@
+/*
+  Yamaha QX1 floppy drive emulator
+
+  Francois Basquin, 2014 mar 20
+
+  Hardware abstraction layer: everything the MB8877 core needs from the
+  board. hal_avr.cpp and sdcard.cpp implement it on the Arduino Mini;
+  host/hal_host.cpp implements it on Linux, with a simulated QX1 MPU and
+  the disk images in a host directory.
+*/
+
+#ifndef _H_HAL
+#define _H_HAL
+
+#include <stdint.h>
+
+// ----------------------------------------------------------------------------
+// Bus port: QX1 data bus (DAL), DRQ and IRQ lines
+// ----------------------------------------------------------------------------
+void	begin_qx1(void);		// Set the lines up and attach the bus interrupt, once
+void	read_qx1(void);			// Serve a register access from the MPU (interrupt)
+void	drq_qx1(bool);			// Drive the DRQ line
+void	irq_qx1(bool);			// Drive the IRQ line
+unsigned long time_qx1(void);		// Microseconds, for the DRQ timeout
+
+// ATOMIC_QX1 { ... }: the bus interrupt is held off inside the block, so a
+// read-modify-write of a register it also changes does not lose its update.
+// The host calls read_qx1() from the loop itself and needs no guard.
+#ifdef __AVR__
+#include <util/atomic.h>
+#define ATOMIC_QX1	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#else
+#define ATOMIC_QX1
+#endif
+
+// ----------------------------------------------------------------------------
+// Block device: SD card and current virtual disk
+// ----------------------------------------------------------------------------
+void	scanSD(void);			// Mount the card and index its disks; sets FDC_ST_NOTREADY if none
+int	findDisk(int, int);		// First disk from number going up (1) or down (-1), -1 if none
+bool	disk_open(int);			// Open DISK_nnn.QX1
+void	disk_close(void);
+bool	disk_seek(unsigned long);
+int	disk_read(unsigned char*, int);
+int	disk_write(const unsigned char*, int);
+void	disk_flush(void);
+
+// Raw access to the images (see sdcard.cpp)
+struct extent {				// Run of consecutive card blocks
+	uint32_t block;			// First card block
+	uint16_t length;		// Image blocks in the run
+};
+
+int	imageMap(int, struct extent*, int);	// Runs of the image file in order (CRC zone included); 0 if it needs more
+unsigned int fatReads(void);		// FAT lookups since the last call
+uint8_t streamStart(uint32_t);		// Multi-block read from this block
+uint8_t streamBlock(void);		// Start token of the next block of the stream
+uint8_t streamChunk(uint8_t*, uint16_t);	// Next bytes of that block, in as many pieces as wanted
+void	streamStop(void);
+uint8_t writeStart(uint32_t, uint16_t);	// Multi-block write from this block, that many blocks pre-erased
+uint8_t writeBlock(const uint8_t*);	// Next block of it
+void	writeStop(void);
+
+#endif
@@ -0,0 +1,242 @@
+/*
+	Yamaha QX1 floppy drive emulator
+
+	Francois Basquin, 2014 mar 20
+
+	AVR backend of the hardware abstraction layer (hal.h): QX1 bus, DRQ and
+	IRQ lines on the Arduino Mini ports, current virtual disk on the SD card.
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <SD.h>
+
+#include "mb8877.h"
+#include "qx1.h"
+#include "hal.h"
+#include "sdcard.h"
+#include "pins.h"
+
+extern volatile char qx1bus;
+
+// ----------------------------------------------------------------------------
+// Bus interrupt
+// ----------------------------------------------------------------------------
+//	INT0 falls on every register access of the MPU and is attached once,
+//	from setup(). Timer 1 runs at the CPU clock so the interrupt can time
+//	the data register accesses itself: bus_cycles / bus_bytes is the cost
+//	of a transferred byte, bus_worst the longest one. The count starts
+//	after the ISR prologue and stops before the epilogue: entering and
+//	leaving the interrupt adds about 80 cycles to each access.
+
+volatile unsigned long	bus_cycles;	// CPU cycles spent serving DATA
+volatile unsigned int	bus_bytes,	// DATA accesses served
+			bus_worst;	// Longest one (cycles)
+
+void begin_qx1(void)
+{
+	Bus::input();				// Pullup on INT0
+	BusSelect::output();
+	BusSelect::write(BUS_SELECT_ADDRESS);
+	DrqPin::high();				// Inactive
+	DrqPin::output();
+	IrqPin::low();
+	IrqPin::output();
+
+	EICRA = (EICRA & ~((1 << ISC01)|(1 << ISC00))) | (1 << ISC01);	// Falling edge
+	EIFR = 1 << INTF0;
+	EIMSK |= 1 << INT0;
+
+	TCCR1A = 0;
+	TCCR1B = 1 << CS10;			// Timer 1 at the CPU clock
+}
+
+ISR(INT0_vect) {
+	uint16_t start = TCNT1, cycles;
+
+	read_qx1();
+	if ((qx1bus & 0x0c) == 0x0c)		// DATA
+	{
+		cycles = TCNT1 - start;
+		bus_cycles += cycles;
+		bus_bytes++;
+		if (cycles > bus_worst) bus_worst = cycles;
+	}
+}
+
+// ----------------------------------------------------------------------------
+// Drive the DRQ and IRQ lines
+// ----------------------------------------------------------------------------
+//	The MPU answers by reading or writing the data register, which
+//	read_qx1() serves; the byte of a read is already in reg[DATA], and
+//	served() loads the next one from the FIFO while the MPU latches it, so
+//	DRQ only drops when the FIFO is empty (read) or full (write).
+
+void drq_qx1(bool level)
+{
+	if (level) DrqPin::low();
+	else DrqPin::high();
+}
+
+void irq_qx1(bool level)
+{
+	if (level) IrqPin::high();
+	else IrqPin::low();
+}
+
+unsigned long time_qx1(void)
+{
+	return micros();
+}
+
+// A register read: the byte on DAL, latched as the select goes back to the
+// address lines, then PORTD an input again with the pull-up on INT0
+static inline void serve_qx1(uint8_t byte)
+{
+	Bus::output();
+	Bus::write(byte);
+	BusSelect::write(BUS_SELECT_ADDRESS);	// Latch the bus
+	Bus::input();
+}
+
+// ----------------------------------------------------------------------------
+// We've got an interrupt. We scan /RD, /WR, A0 and A1 to determine what is
+// requested.
+//
+//    X   X   X   X  A1  A0 /WR /RD         MPU wants to ...
+//  ---+---+---+---+---+---+---+---+------+---------------------------
+//   -   -   -   -   0   0   0   1 | 0x01 | write to reg[CMD]
+//   -   -   -   -   0   0   1   0 | 0x02 | read reg[STATUS]
+//   -   -   -   -   0   1   0   1 | 0x05 | write to reg[TRACK]
+//   -   -   -   -   0   1   1   0 | 0x06 | read reg[TRACK]
+//   -   -   -   -   1   0   0   1 | 0x09 | write to reg[SECTOR]
+//   -   -   -   -   1   0   1   0 | 0x0a | read reg[SECTOR]
+//   -   -   -   -   1   1   0   1 | 0x0d | write to reg[DATA]
+//   -   -   -   -   1   1   1   0 | 0x0e | read reg[DATA]
+//
+// All other values are impossible to occur.
+// ----------------------------------------------------------------------------
+
+void read_qx1() {
+	qx1bus = Bus::read() & 0x0f;		// Get value
+	BusSelect::write(BUS_SELECT_DATA);	// Prepare bus to get data
+
+  switch(qx1bus)
+  {
+    // QX1 MPU wants to write to a register; we get the value from PORTD
+    case 0x01: mb8877.reg[CMD] = Bus::read(); mb8877.command(); break;
+    case 0x05: mb8877.reg[TRACK] = Bus::read(); break;
+    case 0x09: mb8877.reg[SECTOR] = Bus::read(); break;
+    case 0x0d: mb8877.reg[DATA] = Bus::read(); mb8877.served(); break;
+
+    // QX1 MPU wants to read from a register; we serve the value on PORTD
+    case 0x02: serve_qx1(mb8877.reg[STATUS]); break;
+    case 0x06: serve_qx1(mb8877.reg[TRACK]); break;
+    case 0x0a: serve_qx1(mb8877.reg[SECTOR]); break;
+    case 0x0e: serve_qx1(mb8877.reg[DATA]); mb8877.served(); break;
+  }
+  BusSelect::write(BUS_SELECT_ADDRESS);	// Ready for the next access
+}
+
+// ----------------------------------------------------------------------------
+// RAM budget
+// ----------------------------------------------------------------------------
+//	Nothing is allocated at run time: the variables end at _end and the
+//	stack comes down from RAMEND. ram_paint() fills that gap at start up,
+//	before main(); the bytes the stack never reached, interrupts included,
+//	still hold the paint, so ram_unused() is the margin the deepest stack
+//	seen so far has left.
+
+#define RAM_PAINT	0xc5
+
+extern uint8_t	_end, __stack;
+
+void ram_paint(void) __attribute__((naked, used, section(".init3")));
+void ram_paint(void)
+{
+	uint8_t	*p;
+
+	for (p = &_end; p <= &__stack; p++) *p = RAM_PAINT;
+}
+
+unsigned int ram_unused(void)
+{
+	const uint8_t	*p = &_end;
+
+	while (p <= &__stack && *p == RAM_PAINT) p++;
+	return p - &_end;
+}
+
+// Between the variables and the stack, stack included
+unsigned int ram_free(void)
+{
+	return &__stack + 1 - &_end;
+}
+
+// ----------------------------------------------------------------------------
+// Current virtual disk, through SdFile
+// ----------------------------------------------------------------------------
+//	The disk is a static SdFile rather than a File, which would malloc()
+//	a copy of it at every RESTORE. On a slot card there is no file: the
+//	disk is a run of raw blocks from slot, and every access is a whole
+//	aligned block read or written by number (the core only moves 512 bytes
+//	blocks).
+
+static SdFile	disk;		// Current virtual disk
+static uint32_t	slot,		// Its first block on a slot card, 0 on FAT
+		position;	// Cursor in the slot
+
+bool disk_open(int n)
+{
+	disk_close();				// RESTORE opens the disk again
+	position = 0;
+	if ((slot = slotBlock(n))) return true;
+	return openDisk(&disk, n, O_RDWR);
+}
+
+void disk_close(void)
+{
+	if (slot) slot = 0;
+	else if (disk.isOpen()) disk.close();
+}
+
+bool disk_seek(unsigned long offset)
+{
+	if (! slot)
+	{
+		fatWalk(disk.curPosition(), offset);
+		return disk.seekSet(offset);
+	}
+	if (offset % 512 || offset / 512 >= slotBlocks()) return false;	// Image, then its CRC zone
+	position = offset;
+	return true;
+}
+
+int disk_read(unsigned char *buf, int n)
+{
+	if (! slot)
+	{
+		fatWalk(disk.curPosition(), disk.curPosition() + n);
+		return disk.read(buf, n);
+	}
+	if (n != 512 || ! card.readBlock(slot + position / 512, buf)) return -1;
+	position += 512;
+	return n;
+}
+
+int disk_write(const unsigned char *buf, int n)
+{
+	if (! slot)
+	{
+		fatWalk(disk.curPosition(), disk.curPosition() + n);
+		return disk.write(buf, n);
+	}
+	if (n != 512 || ! card.writeBlock(slot + position / 512, buf)) return -1;
+	position += 512;
+	return n;
+}
+
+void disk_flush(void)
+{
+	if (! slot) disk.sync();
+}
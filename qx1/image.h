@@ -0,0 +1,47 @@
+/*
+  Yamaha QX1 floppy drive emulator
+
+  Francois Basquin, 2014 mar 20
+
+  Image formats. Version 1 is the raw layout of qx1.h: the sector data from
+  byte 0, then the CRC zone if any (see crczone.h). Version 2 puts a struct
+  qx1image in a card block of its own ahead of the same data, so the image
+  says what it is and which geometry it was made for, and every sector
+  still starts on a card block of the file. The emulator tells them apart
+  when RESTORE opens the disk; host/qx1img converts between them.
+
+  A version 2 image may be sparse (IMAGE_SPARSE): the rest of the header
+  block then has one bit per sector in image order, set once the sector
+  holds anything but the fill byte. The emulator serves the other sectors
+  from that byte without reading the card, and sets the bit of a sector
+  before its first write; WRITE TRACK clears it again when it formats the
+  sector with the fill byte. qx1img sparse builds the bits of an image.
+
+  Integers are little endian, as on the AVR.
+*/
+
+#ifndef _H_IMAGE
+#define _H_IMAGE
+
+#include <stdint.h>
+
+#define IMAGE_MAGIC	"QX1IMG"	// 6 bytes, no terminating zero
+#define IMAGE_VERSION	2
+#define IMAGE_HEAD	1		// Card blocks before the sector data
+#define IMAGE_USED	16		// Byte of the header block where the sector bits start
+
+#define IMAGE_SPARSE	0x01		// flags: the sector bits are kept up to date
+
+struct qx1image {
+	char	magic[6];		// IMAGE_MAGIC
+	uint8_t	version;		// IMAGE_VERSION
+	uint8_t	head;			// Card blocks before the sector data, IMAGE_HEAD
+	uint16_t sectors;		// Sectors of the geometry (sector_count)
+	uint16_t blocks;		// Card blocks of sector data (image_size / 512)
+	uint8_t	sides;			// Of the geometry
+	uint8_t	tracks;
+	uint8_t	flags;			// IMAGE_*
+	uint8_t	fill;			// Byte of the sectors whose bit is clear
+};
+
+#endif
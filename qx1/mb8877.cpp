@@ -19,159 +19,276 @@ References
 #define TRUE 1
 #define FALSE !TRUE
 
+#include <string.h>
+
 #include "mb8877.h"
 #include "qx1.h"
 #include "crc.h"
-
-
-#ifndef _H_SDCARD
-#include "sdcard.h"
-#endif
-
-// ----- Definition of interrupt names
-
-#include <avr/io.h>
-// ----- ISR interrupt service routine
-#include <avr/interrupt.h>
+#include "crczone.h"
+#include "image.h"
+#include "hal.h"
+#include "trace.h"
 
 typedef unsigned int uint;
 // ----------------------------------------------------------------------------
 // Vars and consts
 // ----------------------------------------------------------------------------
 
-// ----- Delay table: 6msec, 12msec, 20msec, 30msec
-static const int delays[4] = {600, 1200, 2000, 3000};
-
-
+//	No heap: the controller is one static object, its buffers, FIFO, CRC
+//	accumulators and transfer cursors included, so its RAM is fixed at link
+//	time (see host/ramreport.sh) and nothing grows over a long session.
 
-int incomingByte = 0;   // for incoming serial data
-int   ndisk=0;            // Number of virtual-disks on SD
-int   lock=false;
-int   side=0,
-      track=0,
-      sector=0;
+MB8877	mb8877;		// The emulated controller
 
-char	filename[13];	// SD card filename
+// Start a CRC with the three 0xa1 sync bytes and the address mark
+static void mark_crc(CRC &c, unsigned char mark)
+{
+	c.reset();
+	c.compute(0xa1);
+	c.compute(0xa1);
+	c.compute(0xa1);
+	c.compute(mark);
+}
 
-extern volatile char qx1bus;
-extern class MB8877 mb8877;
-extern Sd2Card   card;
-extern SdVolume  volume;
-extern SdFile    root;
-extern File      droot;    // Directory root
-extern File      disk;    // Current virtual disk
-extern dir_t     direntry;
 
 
+// ----------------------------------------------------------------------------
+// Constructor
+// ----------------------------------------------------------------------------
+template <class G>
+FDC<G>::FDC()
+{
+	fdc.vector = FDC_SEEK_FORWARD;
+	reg[TRACK] = reg[STATUS] = reg[CMD] = reg[SECTOR] = reg[DATA] = 0;
+	fdc.disk = -1;
+	fdc.track = fdc.side = fdc.cmdtype = 0;
+	fdc.formatting = false;
+	fdc.extents = 0;
+	fdc.stream = fdc.wstream = 0;
+	fdc.loaded = FDC_BUFFER_SIZE;
+	fdc.ahead = -1;
+	fdc.lastread = fdc.predicted = FDC_NOTRACK;
+	fdc.streak = 0;
+	fdc.event = EVENT_NONE;
+	fdc.pending = fdc.drq = fdc.writing = fdc.primed = false;
+	fdc.head = fdc.tail = fdc.acks = fdc.seen = 0;
+	fatreads = 0;
+	reset_stats();
+	fdc.dirty = -1;
+	fdc.crcs = fdc.sparse = fdc.newcrcs = fdc.newused = false;
+}
 
+// ----------------------------------------------------------------------------
+// Destructor
+// ----------------------------------------------------------------------------
+template <class G>
+FDC<G>::~FDC(){}
 
 // ----------------------------------------------------------------------------
-// Interrupt Management
+// INSERT: change virtual disk; the next RESTORE opens it (-1: none)
 // ----------------------------------------------------------------------------
-volatile int interrupt = false;	// When QX1 pin /RD goes low, Interrupt goes true
 
-ISR(INT0_vect) {
-	// check the value again - since it takes some time to
-	// activate the interrupt routine, we get a clear signal.
-	qx1bus = digitalRead(INT0);
-	interrupt=true;
+template <class G>
+int FDC<G>::number()
+{
+	return fdc.disk;
 }
 
-
+template <class G>
+void FDC<G>::insert(int n)
+{
+	flush_buffer();
+	stop_stream();
+	drop_ahead();
+	disk_close();
+	fdc.crcs = fdc.sparse = false;
+	fdc.lastread = FDC_NOTRACK;
+	fdc.streak = 0;
+	fdc.disk = n;
+	trace_event(TRACE_INSERT, n);
+}
 
 // ----------------------------------------------------------------------------
-//	Scan the SD card and open the volume
-//	Set reg[STATUS] to FDC_ST_NOTREADY if no card present
+// Command engine
 // ----------------------------------------------------------------------------
-void scanSD()
+//	The bus interrupt only latches the registers: command() takes a new
+//	command, served() notes that the MPU answered a DRQ. The commands run
+//	from loop() through step(), a small piece at a time, so STATUS reads are
+//	answered while they run and BUSY and DRQ follow what is really going on.
+//	cmd_* set a command up; fdc.event then tells step() where it stands
+//	(see the EVENT_* ids in mb8877.h). Type II and III commands move their
+//	bytes as fields (FIELD_*) through a small FIFO: step() keeps it ahead of
+//	the MPU, and the bus interrupt takes the next byte from it (read) or puts
+//	the byte written in it (write) as soon as DATA is accessed, so DRQ stays
+//	up from one byte to the next until the FIFO runs dry (read) or full
+//	(write).
+
+// Bus interrupt: the MPU wrote the command register. A command written
+// while another one runs is ignored, except FORCE INTERRUPT.
+template <class G>
+void FDC<G>::command()
 {
-	if (!card.init(SPI_FULL_SPEED, SD_CHIP_SELECT_PIN))
+	if ((reg[STATUS] & FDC_ST_BUSY) && (reg[CMD] & 0xf0) != 0xd0) return;
+	reg[STATUS] |= FDC_ST_BUSY;
+	fdc.pending = true;
+}
+
+// Bus interrupt: the MPU read or wrote the data register. On a read, DATA
+// has just been put on the bus and is loaded with the next byte.
+template <class G>
+void FDC<G>::served()
+{
+	if (! fdc.drq)				// No byte there: it is lost
 	{
-		Serial.print("Init failed, error:");
-		Serial.println(card.errorCode());
-		mb8877.reg[STATUS] = FDC_ST_NOTREADY;
+		if (fdc.event == EVENT_MULTI1) reg[STATUS] |= FDC_ST_LOSTDATA;
 		return;
 	}
+	fdc.acks++;
+	if (fdc.writing)
+	{
+		fifo[fdc.head++ % FDC_FIFO_SIZE] = reg[DATA];
+		if (--fdc.expect && (unsigned char)(fdc.head - fdc.tail) < FDC_FIFO_SIZE) return;
+	}
+	else if (fdc.head != fdc.tail)
+	{
+		reg[DATA] = fifo[fdc.tail++ % FDC_FIFO_SIZE];
+		return;
+	}
+	drop_drq();
+}
 
-#ifdef SD_DEBUG
-	Serial.print("\nCard type: ");
-	switch(card.type()) {
-		case SD_CARD_TYPE_SD1: Serial.println("SD1"); break;
-		case SD_CARD_TYPE_SD2: Serial.println("SD2"); break;
-		case SD_CARD_TYPE_SDHC: Serial.println("SDHC"); break;
-		default: Serial.println("Unknown");
+// Called from loop(): take the new command, or run the current one further
+template <class G>
+void FDC<G>::step()
+{
+	if (fdc.pending)
+	{
+		fdc.pending = false;
+		decode_command();
 	}
-#endif
 
-	if (!volume.init(card)) {
-#ifdef SD_DEBUG
-		Serial.println("Could not find FAT16/FAT32 partition.\nMake sure you've formatted the card");
-#endif
-		mb8877.reg[STATUS] = FDC_ST_NOTREADY;
-		return;
+	switch(fdc.event)
+	{
+		case EVENT_SEEK: seek_track(); break;
+		case EVENT_SEEKEND: end_seek(); break;
+		case EVENT_SEARCH: search(); break;
+		case EVENT_TYPE4: interrupt(); break;
+		case EVENT_MULTI1: transfer(); break;
+		case EVENT_MULTI2: next_field(); break;
+		case EVENT_LOST: lost(); break;
+		case EVENT_NONE: if (! read_ahead()) check_sector(); break;	// Idle
 	}
+}
 
-#ifdef SD_DEBUG
-	// ----- Print the type and size of the first FAT-type volume
-	Serial.print("\nVolume type is FAT");
-	Serial.println(volume.fatType(), DEC);
-	Serial.println();
+template <class G>
+void FDC<G>::finish()
+{
+	end_format();
+	write_crcs();		// Those of the sectors written, to the zone
+	if (fdc.cmdtype == FDC_CMD_WR_SEC || fdc.cmdtype == FDC_CMD_WR_MSEC || fdc.cmdtype == FDC_CMD_WR_TRK)
+	{
+		flush_buffer();	// On the card before the MPU hears of it; WRITEFAULT if not
+		stop_stream();	// No card left in a multi-block write between commands
+	}
+	if (fdc.drq) drop_drq();
+	fdc.event = EVENT_NONE;
+	clear_status(FDC_ST_BUSY);
+	fatreads = fatReads();
+	trace_event(TRACE_END, reg[DATA]);
+	count_command();
+	irq_qx1(false);		// Generate interrupt, command completed
+}
 
-	long volumesize;
-	volumesize = volume.blocksPerCluster();    // clusters are collections of blocks
-	volumesize *= volume.clusterCount();       // we'll have a lot of clusters
-	volumesize *= 512;                            // SD card blocks are always 512 bytes
-	Serial.print("Volume size (bytes): ");
-	Serial.println(volumesize);
-#endif
-	root.openRoot(volume);
-	mb8877.reg[STATUS]=0x00;
+template <class G>
+void FDC<G>::raise_drq()
+{
+	fdc.since = time_qx1();
+	fdc.drq = true;
+	set_status(FDC_ST_DRQ);
+	drq_qx1(true);
 }
 
+template <class G>
+void FDC<G>::drop_drq()
+{
+	fdc.drq = false;
+	clear_status(FDC_ST_DRQ);
+	drq_qx1(false);
+}
 
-// ----------------------------------------------------------------------------
-// Constructor
-// ----------------------------------------------------------------------------
-MB8877::MB8877()
+// STATUS bits changed from loop(): the bus interrupt changes STATUS too
+// (BUSY, DRQ, LOSTDATA), so it must not run between the read and the write.
+template <class G>
+void FDC<G>::set_status(unsigned char bits)
 {
-#ifdef FDC_DEBUG
-	Serial.println("FDC Constructor");
-#endif
-	fdc.vector = FDC_SEEK_FORWARD;
-	reg[TRACK] = reg[STATUS] = reg[CMD] = reg[SECTOR] = reg[DATA] = 0;
-	fdc.disk = -1;
-	fdc.track = fdc.side = fdc.cmdtype = 0;
+	ATOMIC_QX1 { reg[STATUS] |= bits; }
 }
 
-// ----------------------------------------------------------------------------
-// Destructor
-// ----------------------------------------------------------------------------
-MB8877::~MB8877(){}
+template <class G>
+void FDC<G>::clear_status(unsigned char bits)
+{
+	ATOMIC_QX1 { reg[STATUS] &= ~bits; }
+}
+
+// Trace record of the registers as they are now
+template <class G>
+void FDC<G>::trace_event(unsigned char kind, unsigned char data)
+{
+	struct trace t = { kind, fdc.cmd, reg[TRACK], reg[SECTOR], data, reg[STATUS], (uint32_t)time_qx1() };
+
+	traceWrite(&t);
+}
 
 // ----------------------------------------------------------------------------
-// VDISK: build virtual disk name
+// Statistics
 // ----------------------------------------------------------------------------
 
-void MB8877::vdisk()
+template <class G>
+unsigned char FDC<G>::stat_kind(unsigned char cmd)
 {
-#ifdef FDC_DEBUG
-  Serial.println("vdisk");
-#endif
-  sprintf(filename,"DISK_%03d.QX1",fdc.disk);
+	if (cmd < 0x20) return cmd >> 4;		// RESTORE, SEEK
+	if (cmd < 0x80) return 2;			// STEP, STEP IN, STEP OUT
+	return (cmd >> 4) - 5;
+}
+
+template <class G>
+void FDC<G>::reset_stats()
+{
+	unsigned char	i;
+
+	memset(&stats, 0, sizeof(stats));
+	for (i = 0; i < STAT_KINDS; i++) stats.kind[i].min = ~0UL;
+}
+
+// The command is done: its latency, and the errors it ended with
+template <class G>
+void FDC<G>::count_command()
+{
+	struct fdcstat	*k = &stats.kind[stat_kind(fdc.cmd)];
+	unsigned long	t = time_qx1() - fdc.started;
+
+	k->count++;
+	k->total += t;
+	if (t < k->min) k->min = t;
+	if (t > k->max) k->max = t;
+
+	if (fdc.cmd < 0x80 || (fdc.cmd & 0xf0) == 0xd0) return;	// Type I, IV: other meanings
+	if (reg[STATUS] & FDC_ST_LOSTDATA) stats.lostdata++;
+	if (reg[STATUS] & FDC_ST_CRCERR) stats.crcerr++;
+	if (reg[STATUS] & FDC_ST_RECNFND) stats.recnfnd++;
+	if (reg[STATUS] & FDC_ST_WRITEFAULT) stats.writefault++;
 }
 
 // ----------------------------------------------------------------------------
 // Type I command: RESTORE
 // ----------------------------------------------------------------------------
-void MB8877::cmd_restore(int cmd)
+template <class G>
+void FDC<G>::cmd_restore(int cmd)
 {
-#ifdef FDC_DEBUG
-	fdcdisplay((char*)" I  RESTORE");
-#endif
 	fdc.cmdtype = cmd;
 	fdc.vector = FDC_SEEK_FORWARD;
 
-	reg[STATUS] = 0x00;
+	reg[STATUS] = FDC_ST_BUSY;
 	
 // I3: issue an interrupt now. This bit can only be reset with another "Force interrupt" command.
 // I2: issue an interrupt at the next index pulse.
@@ -182,8 +299,11 @@ void MB8877::cmd_restore(int cmd)
 // force interrupt if bit0-bit3 is high
 //	if(cmdreg & 0x0f) digitalWrite(FDC_IRQ, HIGH);
 
-	mb8877.vdisk();
-	disk=SD.open(filename,2);
+	stop_stream();
+	disk_open(fdc.disk);
+	fdc.extents = imageMap(fdc.disk, fdc.map, FDC_EXTENTS);	// Card blocks of the image, once
+	fdc.header = open_image();
+	fdc.crcs = open_crcs();
 
 	// To simulate we've got the track number from the first sector encountered,
 	// we compare the current track and the content of track register; if they
@@ -191,256 +311,443 @@ void MB8877::cmd_restore(int cmd)
 
 	if ((reg[CMD] & FDC_FLAG_VERIFICATION) && (reg[TRACK] != fdc.track))
 	{
-		reg[STATUS] = FDC_ST_HEADENG|FDC_ST_SEEKERR;
-	}
-	else
-	{
-		fdc.side = 0x00;
-		reg[TRACK] = fdc.track = 0x00;
-		reg[SECTOR] = 0x00;
-		reg[STATUS] = FDC_ST_TRACK00|FDC_ST_INDEX|FDC_ST_HEADENG;
+		set_status(FDC_ST_HEADENG|FDC_ST_SEEKERR);
+		finish();
+		return;
 	}
+	fdc.side = 0x00;
+	reg[SECTOR] = 0x00;
+	fdc.target = 0;
+	fdc.event = EVENT_SEEK;
 }
 
 // ----------------------------------------------------------------------------
 // Type I command: SEEK
 // ----------------------------------------------------------------------------
 // reg[DATA] contains the track we want to reach
-void MB8877::cmd_seek(char cmd)
+template <class G>
+void FDC<G>::cmd_seek(char cmd)
 {
-#ifdef FDC_DEBUG
-	fdcdisplay((char*)" I  SEEK");
-#endif
 	fdc.cmdtype = cmd;			// Set command type
 	fdc.vector = !(reg[DATA] > fdc.track);	// Determine seek vector
 
-	reg[STATUS] = 0x00;
+	reg[STATUS] = FDC_ST_BUSY;
 
 	if ((reg[CMD] & FDC_FLAG_VERIFICATION) && (reg[TRACK] != fdc.track))
 	{
-		reg[STATUS] = FDC_ST_HEADENG|FDC_ST_SEEKERR;
-	}
-	else
-	{
-		// Set track register
-		reg[TRACK] = fdc.track = (reg[DATA]>FDC_TRACKS)?FDC_TRACKS:(reg[DATA] < 0)?0:reg[DATA];
-		reg[STATUS] = (reg[TRACK] == 0) ? FDC_ST_HEADENG : FDC_ST_HEADENG|FDC_ST_TRACK00;
+		set_status(FDC_ST_HEADENG|FDC_ST_SEEKERR);
+		finish();
+		return;
 	}
+	fdc.target = (reg[DATA]>=G::tracks)?G::tracks-1:reg[DATA];
+	fdc.event = EVENT_SEEK;
 }
 
 // ----------------------------------------------------------------------------
-// Type I command: STEP
+// Type I command: STEP, STEP-IN, STEP-OUT
 // ----------------------------------------------------------------------------
-void MB8877::cmd_step(bool track_update)
+// One track in the direction of fdc.vector (true: towards track 0); STEP-IN
+// and STEP-OUT set it first, STEP keeps the previous one. The T flag (track
+// update) is seen by seek_track() and end_seek().
+template <class G>
+void FDC<G>::cmd_step()
 {
-#ifdef FDC_DEBUG
-	fdcdisplay((char*)" I  STEP");
-#endif
-	if (fdc.vector)
-		cmd_step(FDC_CMD_STEP_OUT, track_update);
-	else 
-	  cmd_step(FDC_CMD_STEP_IN, track_update);
+	fdc.cmdtype = FDC_CMD_STEP_IN;	// Set command type
+	reg[STATUS] = FDC_ST_BUSY;
+
+	if ((reg[CMD] & FDC_FLAG_VERIFICATION) && (reg[TRACK] != fdc.track))
+	{
+		set_status(FDC_ST_HEADENG|FDC_ST_SEEKERR);
+		finish();
+		return;
+	}
+	fdc.target = fdc.track;
+	if (fdc.vector && fdc.track > 0) fdc.target--;			// Previous track
+	if (! fdc.vector && fdc.track < G::tracks-1) fdc.target++;	// Next track
+	fdc.event = EVENT_SEEK;
 }
 
-// ----------------------------------------------------------------------------
-// Type I command: STEP-IN/OUT
-// ----------------------------------------------------------------------------
-void MB8877::cmd_step(char cmd, bool track_update)
+// Type I commands: one track per step; RESTORE and SEEK always update the
+// track register, STEP commands when their T flag is set
+template <class G>
+void FDC<G>::seek_track()
 {
-  fdc.cmdtype = cmd;    // Set command type
-  reg[STATUS] = 0x00;
-
-	if ((reg[CMD] & FDC_FLAG_VERIFICATION) && (reg[TRACK] != fdc.track))
+	if (fdc.track == fdc.target)
 	{
-		reg[STATUS] = FDC_ST_HEADENG|FDC_ST_SEEKERR;
-    return;
+		fdc.event = EVENT_SEEKEND;
+		return;
 	}
- 
-	if(cmd==FDC_CMD_STEP_IN)
-  {
-#ifdef FDC_DEBUG
-    fdcdisplay((char*)" I  STEP_IN");
-#endif
-    fdc.vector = false;      // Reset seek vector
-    fdc.track++;				// Next track
-		if(fdc.track>FDC_TRACKS) fdc.track=FDC_TRACKS;
-		if(track_update) reg[TRACK] = fdc.track;
-		reg[STATUS] |= (reg[CMD] & FDC_FLAG_HEADLOAD)?FDC_ST_HEADENG:0;
- }
- else
- {
-#ifdef FDC_DEBUG
-    fdcdisplay((char*)" I  STEP_OUT");
-#endif
-    fdc.vector = false;      // Reset seek vector
-    fdc.track--;            // Previous track
-    if(fdc.track<0) { fdc.track=0; reg[STATUS] = FDC_ST_TRACK00; }
-    if(track_update) reg[TRACK] = fdc.track;
-    reg[STATUS] |= (reg[CMD] & FDC_FLAG_HEADLOAD)?FDC_ST_HEADENG:0;
- }
+	if (fdc.track < fdc.target) fdc.track++;
+	else fdc.track--;
+	if (fdc.cmd < 0x20 || (fdc.cmd & 0x10)) reg[TRACK] = fdc.track;
+}
+
+template <class G>
+void FDC<G>::end_seek()
+{
+	if (fdc.cmd < 0x20 || (fdc.cmd & 0x10)) reg[TRACK] = fdc.track;
+	if (fdc.track == 0) set_status(FDC_ST_TRACK00);
+	if (fdc.cmd < 0x10) set_status(FDC_ST_INDEX|FDC_ST_HEADENG);		// RESTORE
+	else if (fdc.cmd < 0x20) set_status(FDC_ST_HEADENG);			// SEEK
+	else if (fdc.cmd & FDC_FLAG_HEADLOAD) set_status(FDC_ST_HEADENG);	// STEP
+	finish();
 }
 
 // ----------------------------------------------------------------------------
 // Type II command: READ-DATA
 // ----------------------------------------------------------------------------
-void MB8877::cmd_readdata(char cmd)
+template <class G>
+void FDC<G>::cmd_readdata(char cmd)
 {
-	CRC *crc = new CRC;
-	int16_t	byte,		// the byte we'll read
-		blocksize,	// # bytes to read / sector
-		nsectors;	// # sectors to read
-#ifdef FDC_DEBUG
-	fdcdisplay((char*)" II READ_DATA");
-#endif
-
+	fdc.cmdtype = cmd;
 	reg[STATUS] = FDC_ST_BUSY|FDC_ST_RECNFND;		// Busy and no Record found yet
 
-	// If CMDTYPE is not set, we must compare the side. If CMDTYPE is already set, the side comparison has already been done.
-	if (fdc.cmdtype == 0)
+	// Compare the side if asked to; exit with record not found status if it differs
+	if ((reg[CMD] & FDC_FLAG_VERIFICATION) && (reg[CMD] & 0x08) != fdc.side)
 	{
-		if ((reg[CMD] & FDC_FLAG_VERIFICATION) && (reg[CMD] & 0x08) != fdc.side) return;
+		finish();
+		return;
 	}
-	else
-		fdc.cmdtype = cmd;
-
-	// Calculate the number of sectors we will have to read
-	nsectors = 1;
-	if (fdc.cmdtype != FDC_CMD_RD_SEC) 
-		nsectors = (fdc.track<80 ? FDC_SECTORS_0 : FDC_SECTORS_1) - reg[SECTOR];
-	blocksize = (fdc.track<80) ? FDC_SIZE_SECTOR_0 : FDC_SIZE_SECTOR_1;
 
-	// Try to set file cursor at the desired position.
-	if (! disk.seek(locate()))  return;	// Exit with record not found status
+	// Reads going up the tracks one after the other (see read_ahead())
+	if (fdc.track != fdc.lastread)
+		fdc.streak = fdc.track == fdc.lastread + 1 ? fdc.streak + 1 : 1;
+	fdc.lastread = fdc.track;
 
+	// Sector following the last one to read
+	fdc.last = reg[SECTOR] + 1;
+	if (cmd == FDC_CMD_RD_MSEC)
+		fdc.last = G::first(G::zone(fdc.track), fdc.side) + G::sectors(G::zone(fdc.track));
 
 /*PLUG HERE THE BEHAVIOR IF DATA ADDRESS MARK ON DISK (first byte) IS SET TO DELETE*/
 
-	// Main loop: we'll read the sectors byte per byte,
-	// transfer each byte to the Data register and generate a DRQ
-	for(;reg[SECTOR] < reg[SECTOR]+nsectors; reg[SECTOR]++)
-  {
-		for(fdc.position=0; byte=disk.read()!=-1 && fdc.position < blocksize; fdc.position++)
-		{
-/*			if ((fdc.position==0) && (byte==0xF8))		// Deleted block
-				reg[STATUS] &= FDC_ST_DELETED;*/
-			reg[STATUS] &= ~FDC_ST_RECNFND;		// Reset RECNFND
-      reg[DATA]=byte;
-			if (fdc.cmdtype == FDC_CMD_RD_TRK) crc->compute(reg[DATA]);
-			send_qx1(reg[DATA]);
-		}
-		if (byte==-1)						// End Of Data
-			reg[STATUS] &= FDC_ST_RECNFND;		// Set RECNFND
-		else
-		{
-			if (fdc.cmdtype == FDC_CMD_RD_TRK)		// We read to extra bytes (CRC)
-			{
-				if (! crc->check(disk.read(),1)) reg[STATUS] &= FDC_ST_CRCERR;	// MSB
-				if (! crc->check(disk.read(),0)) reg[STATUS] &= FDC_ST_CRCERR;	// LSB
-				send_qx1(crc->msb());
-				send_qx1(crc->lsb());
-			}
-			crc->reset();
-		}
-  }
+	fdc.event = EVENT_SEARCH;
 }
 
 // ----------------------------------------------------------------------------
 // Type II command: WRITE-DATA
 // ----------------------------------------------------------------------------
-void MB8877::cmd_writedata(char cmd)
+template <class G>
+void FDC<G>::cmd_writedata(char cmd)
 {
-  unsigned char BYTE,		// the byte to serve
-		blocksize,	// # bytes / sector
-		nsectors;	// # sectors to write
-#ifdef FDC_DEBUG
-	fdcdisplay((char*)" II WRITE_DATA");
-#endif
+	fdc.cmdtype = cmd;
+	reg[STATUS] = FDC_ST_BUSY;
 
-	// Calculate the number of sectors we will have to write
-	nsectors = 1;
-	if (fdc.cmdtype == FDC_CMD_WR_MSEC)
-		nsectors = (fdc.track<80 ? FDC_SECTORS_0 : FDC_SECTORS_1) - reg[SECTOR];
-	
-	blocksize = (fdc.track<80) ? FDC_SIZE_SECTOR_0 : FDC_SIZE_SECTOR_1;
+	// Make some comparison: is it the desired side ? (locate() checks reg[SECTOR])
+
+	if ((reg[CMD] & FDC_FLAG_VERIFICATION) && (reg[CMD] & 0x08) != fdc.side)
+	{
+		set_status(FDC_ST_RECNFND);
+		finish();		// Exit with record not found status
+		return;
+	}
 
-	reg[STATUS] = FDC_ST_BUSY|FDC_ST_HEADENG;
+	// Sector following the last one to write
+	fdc.last = reg[SECTOR] + 1;
+	if (fdc.cmdtype == FDC_CMD_WR_MSEC)
+		fdc.last = G::first(G::zone(fdc.track), fdc.side) + G::sectors(G::zone(fdc.track));
 
-	// Make some comparison: is it the desired side ? Is reg[SECTOR] Ok ?
+	fdc.event = EVENT_SEARCH;
+}
 
-	if (((reg[CMD] & FDC_FLAG_VERIFICATION) && (reg[CMD] & 0x08) != fdc.side)
-		|| (reg[SECTOR] > nsectors) )
+// Type II commands: start the data field of the next sector, or end. Sector
+// data goes through the sector buffer one SD block at a time: read blocks
+// come from seek_block()/fill_buffer(), written blocks are only marked
+// dirty and go to the card as a whole when the buffer is needed again
+// (next block), the last one before the command ends (finish()).
+template <class G>
+void FDC<G>::search()
+{
+	if (reg[SECTOR] >= fdc.last)
 	{
-		reg[STATUS] |= FDC_ST_RECNFND;
-		return;			// Exit with record not found status
+		if (! fdc.writing) stop_stream();	// A write ends in finish(), its last block out
+		finish();
+		return;
 	}
-
-	// Main loop: we'll service the sector byte per byte.
-	// transfer each byte to the Data register and generate a DRQ
-	for(;reg[SECTOR] < reg[SECTOR]+nsectors; reg[SECTOR]++)
+	fdc.offset = locate();
+	if (fdc.offset < 0)
+	{
+		set_status(FDC_ST_RECNFND);
+		stop_stream();
+		finish();			// Exit with record not found status
+		return;
+	}
+	start_field(FIELD_DATA, G::size(G::zone(fdc.track)));
+	if (fdc.writing)
 	{
-		// Write the Data Address Mark on the first byte of the current sector
-		BYTE = (reg[CMD] & FDC_FLAG_DAM) ? 0x01 : 0x00;
-		if (disk.write(&BYTE,1)!=-1)	// Write error
+		if (! mark_used())
 		{
-			reg[STATUS] |= FDC_ST_WRITEFAULT;
+			set_status(FDC_ST_WRITEFAULT);
+			stop_stream();
+			finish();
 			return;
 		}
-		fdc.position=0;
-		do
+		track_crcs();				// Loaded before the data, not in its way
+		mark_crc(crc, 0xfb);			// New CRC for the zone
+		return;
+	}
+	open_sector();
+}
+
+// Read: the data field of the sector at fdc.offset
+template <class G>
+void FDC<G>::open_sector()
+{
+	if (blank_sector())				// Never written: no card access
+	{
+		fdc.fill = fdc.blank;
+		open_field(FIELD_FILL, G::size(G::zone(fdc.track)));
+		clear_status(FDC_ST_RECNFND);
+		stats.blank++;
+	}
+	else open_field(FIELD_DATA, G::size(G::zone(fdc.track)));
+	if (fdc.crctrack == fdc.track && (fdc.bad & (1UL << track_slot(fdc.offset))))
+		set_status(FDC_ST_CRCERR);		// Found wrong in the background
+}
+
+// The field after the one done, in the FIFO straight after it: next run of
+// READ TRACK, next sector of READ MULTIPLE. False if the command has no
+// more, or stops there (wrong CRC, sector not found: next_field() and
+// search() end it as usual).
+template <class G>
+bool FDC<G>::chain_field()
+{
+	long	offset;
+
+	if (fdc.cmdtype == FDC_CMD_RD_TRK) return track_field();
+	if (fdc.cmdtype != FDC_CMD_RD_MSEC || (reg[STATUS] & FDC_ST_CRCERR) || reg[SECTOR] + 1 >= fdc.last)
+		return false;
+	reg[SECTOR]++;
+	if ((offset = locate()) < 0)
+	{
+		reg[SECTOR]--;
+		return false;
+	}
+	fdc.offset = offset;
+	open_sector();
+	return true;
+}
+
+template <class G>
+void FDC<G>::open_field(unsigned char field, unsigned int count)
+{
+	fdc.field = field;
+	fdc.count = count;
+	fdc.position = 0;
+}
+
+// A field on its own: an empty FIFO, DRQ raised once there is a byte
+template <class G>
+void FDC<G>::start_field(unsigned char field, unsigned int count)
+{
+	open_field(field, count);
+	fdc.writing = (fdc.cmdtype == FDC_CMD_WR_SEC || fdc.cmdtype == FDC_CMD_WR_MSEC || fdc.cmdtype == FDC_CMD_WR_TRK);
+	if (fdc.writing) drop_ahead();			// The buffer takes the data
+	fdc.expect = fdc.writing ? count : 0;
+	fdc.head = fdc.tail = 0;
+	fdc.seen = fdc.acks;
+	fdc.event = EVENT_MULTI1;
+}
+
+// Run the field through the FIFO: keep it filled with the next bytes (read)
+// or empty it into the sector buffer (write). The field ends once every
+// byte went through and DRQ is down; READ TRACK and READ MULTIPLE open the
+// next field as soon as one is done instead (chain_field()), so its bytes
+// follow the last ones in the FIFO with no gap. While the FIFO is full, the
+// card block of a read comes into the buffer a FIFO load at a time, so
+// the next block is in, or nearly, by the time the MPU gets to it. With DRQ
+// up and no DATA access for FDC_LOST_TIMEOUT, the MPU is gone.
+template <class G>
+void FDC<G>::transfer()
+{
+	unsigned char	room;
+
+	if (fdc.acks != fdc.seen)
+	{
+		fdc.seen = fdc.acks;
+		fdc.since = time_qx1();
+	}
+	else if (fdc.drq && time_qx1() - fdc.since > FDC_LOST_TIMEOUT)
+	{
+		fdc.event = EVENT_LOST;
+		return;
+	}
+
+	if (fdc.writing)
+	{
+		while (fdc.head != fdc.tail)
 		{
-			qx1bus = 0xff;
-			PORTC &= 0xf0;
-			PORTC |= BUS_SELECT_DATA;			// Prepare bus to get data
-
-			attachInterrupt(0, read_qx1, FALLING);	// Prepare interrupt
-			digitalWrite(FDC_DRQ, LOW);			// Fire DRQ Interrupt
-			__asm__("nop\n\t""nop\n\t");			// Waits ~ 125 nsec
-			if(qx1bus == 0xff)
+			if (fdc.cmdtype == FDC_CMD_WR_TRK)	// Taken apart, not stored as it comes
 			{
-				reg[STATUS] |= FDC_ST_LOSTDATA;	// QX1 did not load DATA in time; exits
-				return;
+				fdc.position++;
+				stats.bytes++;
+				if (! format_byte(fifo[fdc.tail++ % FDC_FIFO_SIZE]))
+				{
+					finish();		// Write error
+					return;
+				}
+				continue;
 			}
-			
-			if (disk.write(&BYTE,1)!=-1)	// Write error
+			if (!(fdc.position % FDC_BUFFER_SIZE) && ! flush_buffer())
 			{
-				reg[STATUS] |= FDC_ST_WRITEFAULT;
+				finish();		// Write error
 				return;
 			}
-		} while (fdc.position++ < blocksize);
+			buffer[fdc.position++ % FDC_BUFFER_SIZE] = fifo[fdc.tail++ % FDC_FIFO_SIZE];
+			stats.bytes++;
+			if (!(fdc.position % FDC_BUFFER_SIZE))	// Block complete
+			{
+				fdc.dirty = fdc.offset + fdc.position - FDC_BUFFER_SIZE;
+				if (fdc.crcs) crc.compute(buffer, FDC_BUFFER_SIZE);
+			}
+		}
+		if (! fdc.drq && fdc.expect) raise_drq();	// Room again
+	}
+	else
+	{
+		while ((room = FDC_FIFO_SIZE - (unsigned char)(fdc.head - fdc.tail)))
+		{
+			if (fdc.position >= fdc.count && ! chain_field()) break;
+			if (! burst(room)) return;
+		}
+		if (fdc.field == FIELD_DATA) load_chunk(FDC_FIFO_SIZE);	// Card work while the MPU drains the FIFO
+		if (! fdc.drq && fdc.head != fdc.tail)
+		{
+			if (fdc.primed) stats.underruns++;	// The MPU had to wait for us
+			fdc.primed = true;
+			ATOMIC_QX1
+			{
+				reg[DATA] = fifo[fdc.tail++ % FDC_FIFO_SIZE];
+				raise_drq();
+			}
+		}
 	}
 
-	nsectors = (fdc.track<80 ? FDC_SECTORS_0 : FDC_SECTORS_1);
-	if(reg[SECTOR]>nsectors) reg[SECTOR]=nsectors;
+	if (fdc.position >= fdc.count && ! fdc.drq && fdc.head == fdc.tail)
+		fdc.event = EVENT_MULTI2;
+}
+
+// Put the next bytes of a read field in the FIFO: as many as there is room
+// for, up to the end of the field or of the card block in the buffer, in
+// one tight copy loop. A block from the stream comes in as it is needed,
+// no more than the FIFO takes at a time. False if the command ended (block
+// not readable).
+template <class G>
+bool FDC<G>::burst(unsigned char room)
+{
+	const unsigned char	*src = fdc.id;
+	unsigned int	n = fdc.count - fdc.position,
+		at = fdc.position % FDC_BUFFER_SIZE;
+	unsigned char	h = fdc.head;
+	bool	ok = true;
+
+	if (fdc.field == FIELD_DATA)
+	{
+		if (! at && fdc.ahead == fdc.offset + (long)fdc.position)
+		{
+			fdc.ahead = -1;			// Read ahead: in the buffer already
+			stats.hits++;
+		}
+		else if (! at) ok = read_block(fdc.offset + fdc.position, false);	// Next block of the sector
+		if (! ok || (fdc.loaded < at + room && ! load_chunk(at + room - fdc.loaded)))
+		{
+			set_status(FDC_ST_RECNFND);	// End Of Data
+			stop_stream();
+			finish();
+			return false;
+		}
+		if (! at) clear_status(FDC_ST_RECNFND);	// Reset RECNFND
+		src = buffer + at;
+		if (n > fdc.loaded - at) n = fdc.loaded - at;
+	}
+	else if (fdc.field == FIELD_BYTES) src += fdc.position;
+	if (n > room) n = room;
+	if (fdc.field == FIELD_DATA && fdc.cmdtype == FDC_CMD_RD_TRK && fdc.crctrack != fdc.track)
+		crc.compute(src, n);			// No stored CRC
+	fdc.position += n;
+	stats.bytes += n;
+
+	if (fdc.field == FIELD_FILL)
+		while (n--) fifo[h++ % FDC_FIFO_SIZE] = fdc.fill;
+	else
+		while (n--) fifo[h++ % FDC_FIFO_SIZE] = *src++;
+	fdc.head = h;				// The bus interrupt may take them from now on
+	return true;
+}
+
+template <class G>
+void FDC<G>::next_field()
+{
+	switch(fdc.cmdtype)
+	{
+		case FDC_CMD_RD_ADDR:
+		case FDC_CMD_WR_TRK: finish(); break;
+		case FDC_CMD_RD_TRK:
+			if (track_field()) fdc.event = EVENT_MULTI1;
+			else
+			{
+				stop_stream();
+				finish();
+			}
+			break;
+		default:					// Type II: next sector
+			if (fdc.writing) store_crc();
+			if (reg[STATUS] & FDC_ST_CRCERR)
+			{
+				stop_stream();
+				finish();
+				break;
+			}
+			reg[SECTOR]++;
+			fdc.event = EVENT_SEARCH;
+	}
+}
+
+// The MPU left a DRQ unanswered: a partial written block is dropped
+template <class G>
+void FDC<G>::lost()
+{
+	set_status(FDC_ST_LOSTDATA);
+	trace_event(TRACE_LOST, fdc.position);
+	if (! fdc.writing) stats.bytes -= (unsigned char)(fdc.head - fdc.tail);	// Never read
+	else if (fdc.crctrack == fdc.track && fdc.offset >= 0)	// The sector no longer matches its CRC
+	{
+		fdc.checked &= ~(1UL << track_slot(fdc.offset));
+		fdc.vslot = fdc.vblock = 0;
+	}
+	drop_drq();
+	stop_stream();
+	finish();
 }
 
 // ----------------------------------------------------------------------------
 // Type III command: READ-ADDRESS
 // ----------------------------------------------------------------------------
-void MB8877::cmd_readaddr(char cmd)
+template <class G>
+void FDC<G>::cmd_readaddr(char cmd)
 {
-	CRC *crc = new CRC;
-#ifdef FDC_DEBUG
-	fdcdisplay((char*)"III READ_ADDR");
-#endif
-  fdc.cmdtype = cmd;
-
-	reg[STATUS] |= FDC_ST_BUSY|FDC_ST_HEADENG;
+	fdc.cmdtype = cmd;
 
-	// Compute CRC
-	crc->compute(reg[TRACK]);
-	crc->compute(fdc.side);
-	crc->compute(reg[SECTOR]);
+	reg[STATUS] = FDC_ST_BUSY;
 
-	// 0x02=512 bytes/sector, 0x03=1024 bytes/sector
-	crc->compute(reg[TRACK]<80 ? 0x03 : 0x02);
+	id_field(reg[TRACK], reg[SECTOR]);
+	start_field(FIELD_BYTES, 6);
+}
 
-	// Send data :
-	send_qx1(reg[TRACK]);			// 1- Track Address
-	send_qx1(fdc.side);				// 2- Side number
-	send_qx1(reg[SECTOR]);			// 3- Sector Address
-	send_qx1((reg[TRACK]<80 ? 0x03 : 0x02));	// 4- Sector length
-	send_qx1(crc->msb());				// 5- CRC1
-	send_qx1(crc->lsb());				// 6- CRC2
+// ID field of a sector in fdc.id, its CRC covering the address mark as on
+// the disk
+template <class G>
+void FDC<G>::id_field(unsigned char track, unsigned char sector)
+{
+	fdc.id[0] = track;				// 1- Track Address
+	fdc.id[1] = fdc.side;				// 2- Side number
+	fdc.id[2] = sector;				// 3- Sector Address
+	fdc.id[3] = G::code(G::zone(track));		// 4- Sector length: 0x02=512 bytes/sector, 0x03=1024 bytes/sector
+
+	mark_crc(crc, 0xfe);
+	crc.compute(fdc.id, 4);
+	fdc.id[4] = crc.msb();				// 5- CRC1
+	fdc.id[5] = crc.lsb();				// 6- CRC2
 }
 
 // ----------------------------------------------------------------------------
@@ -452,77 +759,828 @@ void MB8877::cmd_readaddr(char cmd)
 //	(G) represents generated bytes
 //	(R) represents register bytes
 //	(D) represents actual data bytes.
-
-void MB8877::cmd_readtrack(char cmd)
+//
+//	The track is described by track_template, a run-length list in flash:
+//	runs of one generated byte, and runs standing for the fields made at
+//	run time. The runs from TRACK_SECTOR to RUN_NEXT are sent once per
+//	sector, in the order the sectors pass under the head; GAP 3 and GAP 4
+//	come from the geometry, so the track is GEOMETRY_TRACK_LEN bytes long.
+//	Each run opens a field as soon as the previous one is in the FIFO (see
+//	transfer()), so the track goes out as one burst.
+
+#define RUN_ID		0	// (R) Track, side, sector, size code, (G) CRC
+#define RUN_DATA	1	// (D) Sector data
+#define RUN_CRC		2	// (G) CRC of the data field
+#define RUN_GAP3	3	// (G) GAP 3
+#define RUN_NEXT	4	// Back to TRACK_SECTOR for the next sector
+#define RUN_GAP4	5	// (G) GAP 4, up to the index
+
+#define TRACK_SECTOR	5	// First run of a sector
+#define TRACK_RUNS	18
+
+// { byte, count }, or { RUN_*, 0 }
+static const uint8_t track_template[TRACK_RUNS][2] PROGMEM = {
+	{ 0x4e, 80 },		// 000-079: (G) GAP 0
+	{ 0x00, 12 },		// 080-091: (G) SYNC
+	{ 0xc2, 3 },		// 092-094: (G) Index address mark
+	{ 0xfc, 1 },		// 095: (G) Index address mark
+	{ 0x4e, 50 },		// 096-145: (G) GAP 1
+	{ 0x00, 12 },		// (G) SYNC
+	{ 0xa1, 3 },		// (G) ID address mark
+	{ 0xfe, 1 },		// (G) ID address mark
+	{ RUN_ID, 0 },
+	{ 0x4e, 22 },		// (G) GAP 2
+	{ 0x00, 12 },		// (G) SYNC
+	{ 0xa1, 3 },		// (G) Data address mark
+	{ 0xfb, 1 },		// (G) Data address mark
+	{ RUN_DATA, 0 },
+	{ RUN_CRC, 0 },
+	{ RUN_GAP3, 0 },
+	{ RUN_NEXT, 0 },
+	{ RUN_GAP4, 0 }
+};
+
+template <class G>
+void FDC<G>::cmd_readtrack(char cmd)
 {
-	uint	i;
-
-#ifdef FDC_DEBUG
-	fdcdisplay((char*)"III READ_TRACK");
-#endif
 
 	// type-3 read track
-	 fdc.cmdtype = cmd;
-//	status = FDC_ST_DRQ | FDC_ST_BUSY;
+	fdc.cmdtype = cmd;
 	reg[STATUS] = FDC_ST_BUSY | FDC_ST_RECNFND;
 
 	// If side Compare flag is set, compare the current and desired sides
 	// and exits if they differ.
-	if ((reg[CMD] & FDC_FLAG_VERIFICATION) && (reg[CMD] & 0x08) != fdc.side) return;
-
-	// Try to set file cursor at the desired position.
-	if (! disk.seek(locate()) ) return;	// Exit with record not found status
-
-	// Send ID RECORD
-	for(i=0; i<80; i++) send_qx1(0x4e);	// 000-079: (G) GAP 0
-	for(i=0; i<12; i++) send_qx1(0x00);	// 080-091: (G) SYNC
-	for(i=0; i<3; i++) send_qx1(0xc2);	// 092-(G) Index address mark
-	send_qx1(0xfc);				// (G) Index address mark
-	for(i=0; i<50; i++) send_qx1(0x4e);	// (G) GAP 1
-	for(i=0; i<12; i++) send_qx1(0x00);	// (G) SYNC
-	// Send DATA
-	if(reg[TRACK]<80)
-	{
-		reg[SECTOR]=0+fdc.side*5; cmd_readdata(FDC_CMD_RD_TRK);
-		reg[SECTOR]=3+fdc.side*5; cmd_readdata(FDC_CMD_RD_TRK);
-		reg[SECTOR]=1+fdc.side*5; cmd_readdata(FDC_CMD_RD_TRK);
-		reg[SECTOR]=4+fdc.side*5; cmd_readdata(FDC_CMD_RD_TRK);
-		reg[SECTOR]=2+fdc.side*5; cmd_readdata(FDC_CMD_RD_TRK);
+	if ((reg[CMD] & FDC_FLAG_VERIFICATION) && (reg[CMD] & 0x08) != fdc.side)
+	{
+		finish();
+		return;
 	}
-	else
-		for(i=0; i<9; i++)
-			reg[SECTOR]=0+fdc.side*10; cmd_readdata(FDC_CMD_RD_TRK);
-	for(i=0; i<22; i++) send_qx1(0x4e);	// (G) GAP 2
+
+	track_crcs();
+	fdc.phase = fdc.slot = 0;
+	start_field(FIELD_FILL, 0);			// transfer() opens the first run
+}
+
+// Open the field of the next run; false at the end of the track, or if a
+// sector cannot be found (RECNFND)
+template <class G>
+bool FDC<G>::track_field()
+{
+	unsigned char	zone = G::zone(fdc.track),
+		byte, count;
+
+	while (fdc.phase < TRACK_RUNS)
+	{
+		byte = pgm_read_byte(&track_template[fdc.phase][0]);
+		count = pgm_read_byte(&track_template[fdc.phase++][1]);
+		if (count)
+		{
+			fdc.fill = byte;
+			open_field(FIELD_FILL, count);
+			return true;
+		}
+		switch (byte)
+		{
+			case RUN_ID:
+				reg[SECTOR] = G::sector_at(zone, fdc.side, fdc.slot);
+				id_field(fdc.track, reg[SECTOR]);
+				open_field(FIELD_BYTES, 6);
+				return true;
+			case RUN_DATA:
+				fdc.offset = locate();
+				if (fdc.offset < 0)
+				{
+					set_status(FDC_ST_RECNFND);
+					fdc.phase = TRACK_RUNS;
+					return false;
+				}
+				if (fdc.crctrack != fdc.track) mark_crc(crc, 0xfb);
+				if (! blank_sector())
+				{
+					open_field(FIELD_DATA, G::size(zone));
+					return true;
+				}
+				if (fdc.crctrack != fdc.track)	// CRC of the fill bytes
+				{
+					flush_buffer();
+					memset(buffer, fdc.blank, FDC_BUFFER_SIZE);
+					for (count = 0; count < G::blocks(zone); count++)
+						crc.compute(buffer, FDC_BUFFER_SIZE);
+				}
+				fdc.fill = fdc.blank;
+				open_field(FIELD_FILL, G::size(zone));
+				stats.blank++;
+				return true;
+			case RUN_CRC:			// Stored in the CRC zone, or computed
+				if (fdc.crctrack == fdc.track)
+				{
+					fdc.id[0] = fdc.crc_table[track_slot(fdc.offset)] >> 8;
+					fdc.id[1] = fdc.crc_table[track_slot(fdc.offset)];
+				}
+				else
+				{
+					fdc.id[0] = crc.msb();
+					fdc.id[1] = crc.lsb();
+				}
+				open_field(FIELD_BYTES, 2);
+				return true;
+			case RUN_GAP3:
+				fdc.fill = 0x4e;
+				open_field(FIELD_FILL, G::gap3(zone));
+				return true;
+			case RUN_NEXT:
+				if (++fdc.slot < G::sectors(zone)) fdc.phase = TRACK_SECTOR;
+				break;
+			case RUN_GAP4:
+				fdc.fill = 0x4e;
+				open_field(FIELD_FILL, G::gap4(zone));
+				return true;
+		}
+	}
+	return false;
 }
 
-void MB8877::cmd_writetrack(char cmd)
+// ----------------------------------------------------------------------------
+// Type III command: WRITE-TRACK
+// ----------------------------------------------------------------------------
+//	The QX1 formats a track by writing it whole, as READ TRACK sends it
+//	(track_template), with the MB8877 codes for what cannot be written as
+//	data: 0xf5 for a 0xa1 sync byte, 0xf6 for 0xc2, 0xf7 for the two bytes
+//	of the CRC. Only the ID and data fields mean anything to the image:
+//	format_byte() picks them out of the bytes as they come, gaps, syncs
+//	and CRCs going nowhere. An ID field must be one of the track as the
+//	geometry lays it out (track number, sector of the side, size code);
+//	the data field after it goes to that sector. A data field of one byte
+//	repeated, the way a disk is formatted, never goes through the sector
+//	buffer a byte at a time: its blocks are filled at once (fill_blocks())
+//	and go out through the multi-block write, one card command for the side
+//	unless the image is sparse. On a sparse image, a sector formatted with
+//	its fill byte is blank: no card write if it was blank already, and its
+//	bit cleared otherwise. The track ends after GEOMETRY_TRACK_LEN bytes; an
+//	ID field the image cannot hold, or a sector of the side left without
+//	its data field, ends the command with WRITEFAULT.
+
+#define FORMAT_GAP	0	// Between fields
+#define FORMAT_MARK	1	// After 0xf5: an address mark may follow
+#define FORMAT_ID	2	// ID field, fdc.id
+#define FORMAT_FILL	3	// Data field, all of fdc.fill so far
+#define FORMAT_DATA	4	// Data field, through the sector buffer
+#define FORMAT_DONE	5	// The track is over (end_format())
+
+template <class G>
+void FDC<G>::cmd_writetrack(char cmd)
 {
-#ifdef FDC_DEBUG
-	fdcdisplay((char*)"III WRITE_TRACK");
-#endif
 	// type-3 write track
 	fdc.cmdtype = cmd;
-//	status = FDC_ST_DRQ | FDC_ST_BUSY;
+	fdc.phase = FORMAT_DONE;
 	reg[STATUS] = FDC_ST_BUSY;
+
+	if ((reg[CMD] & FDC_FLAG_VERIFICATION) && (reg[CMD] & 0x08) != fdc.side)
+	{
+		finish();
+		return;
+	}
+
+	track_used(fdc.track);				// Loaded before the data, not in its way
+	track_crcs();
+	fdc.phase = FORMAT_GAP;
+	fdc.offset = -1;
+	fdc.formatted = 0;
+	fdc.formatting = true;
+	start_field(FIELD_DATA, GEOMETRY_TRACK_LEN);
+}
+
+// Next byte of the track from the MPU; false if the card failed
+template <class G>
+bool FDC<G>::format_byte(unsigned char b)
+{
+	switch (fdc.phase)
+	{
+		case FORMAT_GAP:
+			if (b == 0xf5) fdc.phase = FORMAT_MARK;
+			return true;
+		case FORMAT_MARK:
+			if (b == 0xf5) return true;
+			fdc.phase = FORMAT_GAP;
+			fdc.at = 0;
+			if (b == 0xfe) fdc.phase = FORMAT_ID;
+			else if ((b == 0xfb || b == 0xf8) && fdc.offset >= 0)	// Data mark of the sector named last
+			{
+				mark_crc(crc, 0xfb);		// The image keeps no mark: read back as 0xfb
+				fdc.phase = FORMAT_FILL;
+			}
+			return true;
+		case FORMAT_ID:
+			fdc.id[fdc.at++] = b;
+			if (fdc.at == 4)
+			{
+				fdc.offset = format_id();
+				fdc.phase = FORMAT_GAP;		// The CRC (0xf7) follows
+			}
+			return true;
+		case FORMAT_FILL:
+			if (! fdc.at) fdc.fill = b;
+			if (b == fdc.fill)
+			{
+				if (++fdc.at < G::size(G::zone(fdc.track))) return true;
+				return format_sector();
+			}
+			// Another byte: the blocks so far are filled, and the sector
+			// carries on through the buffer as WRITE SECTOR takes it
+			if (! format_used() || ! fill_blocks(0, fdc.at / FDC_BUFFER_SIZE, true) || ! flush_buffer())
+				return false;
+			memset(buffer, fdc.fill, fdc.at % FDC_BUFFER_SIZE);
+			fdc.phase = FORMAT_DATA;
+			// fall through
+		case FORMAT_DATA:
+			if (!(fdc.at % FDC_BUFFER_SIZE) && ! flush_buffer()) return false;
+			buffer[fdc.at++ % FDC_BUFFER_SIZE] = b;
+			if (!(fdc.at % FDC_BUFFER_SIZE))	// Block complete
+			{
+				fdc.dirty = fdc.offset + fdc.at - FDC_BUFFER_SIZE;
+				if (fdc.crcs) crc.compute(buffer, FDC_BUFFER_SIZE);
+			}
+			if (fdc.at < G::size(G::zone(fdc.track))) return true;
+			return format_sector();
+	}
+	return true;						// FORMAT_DONE: the rest of the track
+}
+
+// The ID field in fdc.id: image offset of its sector, -1 if the image
+// cannot hold it. The side byte is not checked: the head is fdc.side,
+// whatever number the MPU gives it.
+template <class G>
+long FDC<G>::format_id()
+{
+	unsigned char	zone = G::zone(fdc.track),
+		b = G::sector_block(zone, fdc.side, fdc.id[2]);
+
+	if (fdc.id[0] != fdc.track || fdc.id[3] != G::code(zone) || b == GEOMETRY_NOSECTOR)
+	{
+		set_status(FDC_ST_WRITEFAULT);
+		return -1;
+	}
+	return (long)(G::track_block(fdc.track) + b) * GEOMETRY_BLOCK;
+}
+
+// The data field of the sector at fdc.offset is in: the blocks of a
+// repeated byte filled, and its CRC to the table. False if the card failed.
+template <class G>
+bool FDC<G>::format_sector()
+{
+	unsigned char	j = track_slot(fdc.offset);
+	bool	blank;
+
+	if (fdc.phase == FORMAT_FILL)
+	{
+		blank = track_used(fdc.track) && fdc.fill == fdc.blank;
+		if (! blank && ! format_used()) return false;
+		if (! fill_blocks(0, G::blocks(G::zone(fdc.track)), ! blank || (fdc.used & (1UL << j))))
+			return false;
+		if (blank && (fdc.used & (1UL << j)))	// The card holds the fill byte: blank from now on
+		{
+			fdc.used &= ~(1UL << j);
+			fdc.newused = true;
+		}
+	}
+	store_crc();
+	fdc.formatted |= 1UL << j;
+	fdc.offset = -1;
+	fdc.phase = FORMAT_GAP;
+	return true;
+}
+
+// A sector of a sparse image is about to get data other than its fill
+// byte: the bits of the sectors of the side not formatted yet go to the
+// header first, in one write (see mark_used())
+template <class G>
+bool FDC<G>::format_used()
+{
+	unsigned char	n = G::sectors(G::zone(fdc.track));
+	unsigned long	bits = (((1UL << n) - 1) << (fdc.side * n)) & ~fdc.formatted;
+
+	if (! track_used(fdc.track) || (fdc.used & bits) == bits) return true;
+	fdc.used |= bits;
+	fdc.newused = false;				// Written with them
+	return write_used();
+}
+
+// Blocks from to to of the sector at fdc.offset, all of fdc.fill: their
+// CRC, and into the buffer as written blocks if write
+template <class G>
+bool FDC<G>::fill_blocks(unsigned char from, unsigned char to, bool write)
+{
+	if (! write && ! fdc.crcs) return true;
+	for (; from < to; from++)
+	{
+		if (! flush_buffer()) return false;
+		memset(buffer, fdc.fill, FDC_BUFFER_SIZE);
+		if (fdc.crcs) crc.compute(buffer, FDC_BUFFER_SIZE);
+		if (write) fdc.dirty = fdc.offset + from * (long)FDC_BUFFER_SIZE;
+	}
+	return true;
+}
+
+// The track is over, or the command cut short: the sector bits cleared by
+// the format to the header. A sector of the side without its data field
+// is not formatted (WRITEFAULT).
+template <class G>
+void FDC<G>::end_format()
+{
+	unsigned char	n = G::sectors(G::zone(fdc.track));
+	unsigned long	side = ((1UL << n) - 1) << (fdc.side * n);
+
+	if (! fdc.formatting) return;		// FORCE INTERRUPT has already replaced cmdtype
+	fdc.formatting = false;
+	fdc.phase = FORMAT_DONE;
+	if ((fdc.formatted & side) != side) set_status(FDC_ST_WRITEFAULT);
+	if (fdc.newused && ! write_used()) set_status(FDC_ST_WRITEFAULT);
+	fdc.newused = false;
 }
 
 // ----------------------------------------------------------------------------
 // Type IV command: FORCE-INTERRUPT
 // ----------------------------------------------------------------------------
 
-void MB8877::cmd_forceint(char cmd)
+template <class G>
+void FDC<G>::cmd_forceint(char cmd)
 {
-#ifdef FDC_DEBUG
-	fdcdisplay((char*)" IV FORCE_INT");
-#endif
 	if(fdc.cmdtype == 0 || fdc.cmdtype == 4) {
 		fdc.cmdtype = cmd;
 		fdc.control ^= (reg[CMD] & 0x0f);
 	}
-	reg[STATUS] &= ~FDC_ST_BUSY;
-	disk.close();
-	
-	if(fdc.control & FDC_INT_NOW) digitalWrite(FDC_IRQ, HIGH);
+	fdc.event = EVENT_TYPE4;
+}
+
+// Abort the command in progress. The disk stays as RESTORE opened it, map,
+// CRC zone and sector bits included: the MB8877 keeps its media.
+template <class G>
+void FDC<G>::interrupt()
+{
+	drop_drq();
+	end_format();
+	write_crcs();
+	flush_buffer();
+	stop_stream();
+
+	if(fdc.control & FDC_INT_NOW) irq_qx1(true);
+	finish();
+}
+
+// ----------------------------------------------------------------------------
+// Sector buffer source
+// ----------------------------------------------------------------------------
+//	RESTORE maps the image to runs of card blocks (usually a single one), so
+//	an image offset turns into a card block without going through the FAT.
+//	Mapped blocks are read with a multi-block command that stays open as long
+//	as the requested blocks follow each other on the card; READ TRACK and the
+//	zone 1 sectors of READ MULTIPLE SECTOR are served by one command per run.
+//	If the image could not be mapped, or the card refuses the stream, the FAT
+//	File is used.
+
+// Card block of image block n, 0 if the image is not mapped
+template <class G>
+unsigned long FDC<G>::map_block(unsigned int n)
+{
+	unsigned char i;
+
+	for (n += fdc.header, i = 0; i < fdc.extents; n -= fdc.map[i++].length)
+		if (n < fdc.map[i].length) return fdc.map[i].block + n;
+	return 0;
+}
+
+// Card block at image offset into the sector buffer. A block the card
+// fails to deliver is read once more through File before giving up. With
+// whole false, a block from the stream only gets as far as its start: its
+// bytes come with load_chunk().
+template <class G>
+bool FDC<G>::read_block(long offset, bool whole)
+{
+	if (seek_block(offset) && fill_buffer(whole) == FDC_BUFFER_SIZE) return true;
+	if (offset < 0) return false;
+	stats.retries++;
+	stop_stream();
+	return seek_file(offset) && disk_read(buffer, FDC_BUFFER_SIZE) == FDC_BUFFER_SIZE;
+}
+
+template <class G>
+bool FDC<G>::seek_block(long offset)
+{
+	unsigned long block;
+
+	flush_buffer();					// The buffer is about to be reused
+	finish_block();
+	drop_ahead();
+	if (offset < 0) return false;			// No such sector
+	if (!(offset % FDC_BUFFER_SIZE) && (block = map_block(offset / FDC_BUFFER_SIZE)))
+	{
+		if (block == fdc.stream) return true;	// Stream is already there
+		stop_stream();
+		disk_flush();				// The card must hold what File wrote
+		if (streamStart(block))
+		{
+			fdc.stream = block;
+			return true;
+		}
+	}
+	stop_stream();
+	return seek_file(offset);
+}
+
+// File position of an image offset, past the header of a version 2 image
+template <class G>
+bool FDC<G>::seek_file(long offset)
+{
+	return disk_seek(fdc.header * (unsigned long)FDC_BUFFER_SIZE + offset);
+}
+
+template <class G>
+int FDC<G>::fill_buffer(bool whole)
+{
+	fdc.loaded = FDC_BUFFER_SIZE;
+	if (! fdc.stream) return disk_read(buffer, FDC_BUFFER_SIZE);
+	if (! streamBlock()) return -1;
+	fdc.loaded = 0;
+	if (whole && ! load_chunk(FDC_BUFFER_SIZE)) return -1;
+	return FDC_BUFFER_SIZE;
+}
+
+// Next n bytes, at most, of the stream block being read into the buffer.
+// False if the card failed; nothing to do once the block is whole.
+template <class G>
+bool FDC<G>::load_chunk(unsigned int n)
+{
+	if (fdc.loaded >= FDC_BUFFER_SIZE) return true;
+	if (n > FDC_BUFFER_SIZE - fdc.loaded) n = FDC_BUFFER_SIZE - fdc.loaded;
+	if (! streamChunk(buffer + fdc.loaded, n)) return false;
+	if ((fdc.loaded += n) == FDC_BUFFER_SIZE) fdc.stream++;
+	return true;
+}
+
+// The rest of a stream block read in part, before the stream or the
+// buffer serve anything else
+template <class G>
+void FDC<G>::finish_block()
+{
+	if (fdc.loaded < FDC_BUFFER_SIZE && ! load_chunk(FDC_BUFFER_SIZE))
+	{
+		fdc.loaded = FDC_BUFFER_SIZE;		// The card failed: the stream is of no use
+		fdc.stream++;
+	}
+}
+
+// Write back the sector buffer if it holds a block not yet on the card
+template <class G>
+bool FDC<G>::flush_buffer()
+{
+	bool	ok;
+
+	finish_block();
+	if (fdc.dirty < 0) return true;
+	ok = write_block(fdc.dirty);
+	if (! ok) set_status(FDC_ST_WRITEFAULT);
+	fdc.dirty = -1;
+	return ok;
+}
+
+// Ends the multi-block read or write, whichever is open
+template <class G>
+void FDC<G>::stop_stream()
+{
+	if (fdc.wstream)
+	{
+		writeStop();
+		fdc.wstream = 0;
+	}
+	if (! fdc.stream) return;
+	finish_block();
+	streamStop();
+	fdc.stream = 0;
+}
+
+// ----------------------------------------------------------------------------
+// Sector buffer sink
+// ----------------------------------------------------------------------------
+//	A written block of a mapped image goes to the card through a multi-block
+//	write, opened at the first block the command writes and kept open as
+//	long as the blocks written follow each other on the card: one card
+//	command for the sectors of a zone 1 side, one per sector in zone 0,
+//	where the interleave puts the next sector elsewhere. The card programs
+//	a block while the next one comes from the MPU. Only the rest of the
+//	sector in progress is pre-erased (write_run()): a pre-erased block the
+//	write never gets to is undefined, so a command cut short may damage
+//	that sector and no other. The write ends with the command (finish()).
+//	Unmapped images, and blocks the card refuses, go through File.
+
+// Card blocks to pre-erase from image offset on: the rest of the sector at
+// fdc.offset, one for a block that is not in it (CRC zone, sector before)
+template <class G>
+unsigned int FDC<G>::write_run(long offset)
+{
+	long	end = fdc.offset + G::size(G::zone(fdc.track));
+
+	if (fdc.offset < 0 || offset < fdc.offset || offset >= end) return 1;
+	return (end - offset) / GEOMETRY_BLOCK;
+}
+
+// The sector buffer to the card block at image offset. Whole aligned blocks
+// written through File go straight to the card, without a read-modify-write
+// of the FAT cache.
+template <class G>
+bool FDC<G>::write_block(long offset)
+{
+	unsigned long	block = map_block(offset / FDC_BUFFER_SIZE);
+	unsigned int	n;
+
+	if (block && block != fdc.wstream)
+	{
+		stop_stream();
+		disk_flush();				// The card must hold what File wrote
+		for (n = write_run(offset); n > 1 && map_block(offset / FDC_BUFFER_SIZE + n - 1) != block + n - 1; n--);
+		if (writeStart(block, n)) fdc.wstream = block;	// Not past the end of the run on the card
+	}
+	if (block && block == fdc.wstream && writeBlock(buffer))
+	{
+		fdc.wstream++;
+		return true;
+	}
+	stop_stream();
+	return seek_file(offset) && disk_write(buffer, FDC_BUFFER_SIZE) == FDC_BUFFER_SIZE;
+}
+
+// Card blocks ahead of the sector data: those of a version 2 header made
+// for this geometry, 0 for a raw image (see image.h). The sector offsets
+// of the core stay those of the raw layout; map_block() and seek_file()
+// skip the header.
+template <class G>
+unsigned char FDC<G>::open_image()
+{
+	const struct qx1image *h = (const struct qx1image*)buffer;
+
+	static_assert(IMAGE_USED + (G::sector_count + 7) / 8 <= GEOMETRY_BLOCK, "sector bits do not fit the header");
+
+	fdc.header = 0;
+	fdc.sparse = false;
+	if (! seek_block(0) || fill_buffer() != FDC_BUFFER_SIZE
+	 || memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) || h->version != IMAGE_VERSION) return 0;
+	if (h->sectors != G::sector_count || h->blocks != G::image_size / GEOMETRY_BLOCK
+	 || h->sides != G::sides || h->tracks != G::tracks) return 0;	// Another drive (the index keeps them out)
+	fdc.sparse = h->flags & IMAGE_SPARSE;
+	fdc.blank = h->fill;
+	fdc.usedtrack = FDC_NOTRACK;
+	return h->head;
+}
+
+// ----------------------------------------------------------------------------
+// Read-ahead
+// ----------------------------------------------------------------------------
+//	The QX1 loads a song track after track: a step or seek, then the
+//	sectors of the new track. Once reads went up FDC_AHEAD_STREAK tracks one
+//	after the other, the idle steps open the stream at the first block of
+//	the next track, so the card command is done before the MPU steps, and
+//	load that block into the buffer a FIFO load at a time. A read of that
+//	block takes it as it is (stats.hits); anything else using the buffer
+//	drops it (stats.misses). Two sectors do not fit in RAM next to the SD
+//	library, so the stream and the sector buffer are all there is to read
+//	ahead into. The background CRC check waits while a block is held.
+
+// Idle work of the read-ahead; false if there is none
+template <class G>
+bool FDC<G>::read_ahead()
+{
+	long	offset;
+
+	if (fdc.ahead >= 0)
+	{
+		if (fdc.track != fdc.lastread && fdc.track != fdc.lastread + 1)
+		{
+			drop_ahead();			// The MPU went elsewhere
+			return false;
+		}
+		load_chunk(FDC_FIFO_SIZE);
+		return true;
+	}
+	if (fdc.streak < FDC_AHEAD_STREAK || fdc.predicted == fdc.lastread || fdc.lastread + 1 >= G::tracks)
+		return false;
+	fdc.predicted = fdc.lastread;
+	if (track_used(fdc.lastread + 1) && ! (fdc.used & 1)) return false;	// Its first sector is blank
+	offset = (long)G::track_block(fdc.lastread + 1) * GEOMETRY_BLOCK;
+	if (! read_block(offset, false)) return false;
+	fdc.ahead = offset;
+	return true;
+}
+
+// The block read ahead is about to go, unused
+template <class G>
+void FDC<G>::drop_ahead()
+{
+	if (fdc.ahead < 0) return;
+	fdc.ahead = -1;
+	stats.misses++;
+}
+
+// ----------------------------------------------------------------------------
+// Sparse image
+// ----------------------------------------------------------------------------
+//	The header of a sparse image (see image.h) has a bit per sector: clear
+//	if it never held anything but the fill byte. Those of the current track
+//	are kept in fdc.used, read from the header the first time they are
+//	needed on it; a type II read or READ TRACK sends a blank sector as a
+//	FIELD_FILL of that byte, with no card access. The bit of a blank sector
+//	goes to the header before the sector is first written, so a write cut
+//	short leaves the sector read from the card; WRITE TRACK clears the bit
+//	of a sector it formats with the fill byte once the card holds it.
+
+// Block 0 of the file, the header, into the sector buffer
+template <class G>
+bool FDC<G>::read_header()
+{
+	if (! flush_buffer()) return false;
+	stop_stream();
+	drop_ahead();
+	return disk_seek(0) && disk_read(buffer, FDC_BUFFER_SIZE) == FDC_BUFFER_SIZE;
+}
+
+// Sector bits of a track into fdc.used; false if the image has none
+// (every sector then comes from the card)
+template <class G>
+bool FDC<G>::track_used(unsigned char track)
+{
+	unsigned int	i = G::track_sector(track);
+	unsigned char	k, n = G::sides * G::sectors(G::zone(track));
+
+	if (! fdc.sparse) return false;
+	if (fdc.usedtrack == track) return true;
+	if (! read_header())
+	{
+		fdc.sparse = false;			// Header unreadable: do without
+		return false;
+	}
+	fdc.used = 0;
+	for (k = 0; k < n; k++, i++)
+		if (buffer[IMAGE_USED + i / 8] & (1 << (i & 7))) fdc.used |= 1UL << k;
+	fdc.usedtrack = track;
+	return true;
+}
+
+// Whether the sector at fdc.offset holds nothing but the fill byte
+template <class G>
+bool FDC<G>::blank_sector()
+{
+	return track_used(fdc.track) && ! (fdc.used & (1UL << track_slot(fdc.offset)));
+}
+
+// The sectors the command writes from fdc.offset on are about to be: their
+// bits to the header first if the first one is still clear, so the others
+// cost no header write of their own. False if the header cannot be written.
+template <class G>
+bool FDC<G>::mark_used()
+{
+	unsigned char	zone = G::zone(fdc.track), id, b;
+
+	if (! blank_sector()) return true;
+	for (id = reg[SECTOR]; id < fdc.last && (b = G::sector_block(zone, fdc.side, id)) != GEOMETRY_NOSECTOR; id++)
+		fdc.used |= 1UL << (b / G::blocks(zone));
+	return write_used();
+}
+
+// The bits of fdc.used to the header
+template <class G>
+bool FDC<G>::write_used()
+{
+	unsigned int	i = G::track_sector(fdc.usedtrack);
+	unsigned char	k, n = G::sides * G::sectors(G::zone(fdc.usedtrack));
+
+	if (! read_header()) return false;
+	for (k = 0; k < n; k++, i++)
+		if (fdc.used & (1UL << k)) buffer[IMAGE_USED + i / 8] |= 1 << (i & 7);
+		else buffer[IMAGE_USED + i / 8] &= ~(1 << (i & 7));
+	return disk_seek(0) && disk_write(buffer, FDC_BUFFER_SIZE) == FDC_BUFFER_SIZE;
+}
+
+// ----------------------------------------------------------------------------
+// CRC zone
+// ----------------------------------------------------------------------------
+//	If the image has a CRC zone (see crczone.h), the CRCs of the current
+//	track are read into fdc.crc_table the first time they are needed on it.
+//	READ TRACK sends them as they are, and a sector written whole gets its
+//	entry rewritten, in the zone once the command ends. While no command
+//	runs, step() checks the sectors of the track against them, one card
+//	block per call: a type II read of a sector found wrong ends with
+//	CRCERR, as a bad data field would. The map covers the zone as well (see
+//	imageMap()).
+
+// Whether the image carries a zone for this geometry
+template <class G>
+bool FDC<G>::open_crcs()
+{
+	const struct crczone *z = (const struct crczone*)buffer;
+
+	fdc.crctrack = FDC_NOTRACK;
+	return seek_block(G::image_size) && fill_buffer() == FDC_BUFFER_SIZE
+		&& ! memcmp(z->magic, CRCZONE_MAGIC, sizeof(z->magic)) && z->sectors == G::sector_count;
+}
+
+// CRCs of the current track into fdc.crc_table; false if there are none
+template <class G>
+bool FDC<G>::track_crcs()
+{
+	unsigned long	at = G::image_size + CRCZONE_HEAD + 2UL * G::track_sector(fdc.track);
+	unsigned char	i, n = G::sides * G::sectors(G::zone(fdc.track));
+	unsigned int	k;
+
+	if (! fdc.crcs) return false;
+	if (fdc.crctrack == fdc.track) return true;
+	for (i = 0; i < n; i++, at += 2)
+	{
+		k = at % FDC_BUFFER_SIZE;
+		if ((! i || ! k) && ! read_block(at - k))
+		{
+			fdc.crcs = false;		// Zone unreadable: do without
+			return false;
+		}
+		fdc.crc_table[i] = buffer[k] << 8 | buffer[k + 1];
+	}
+	fdc.crctrack = fdc.track;
+	fdc.checked = fdc.bad = 0;
+	fdc.vslot = fdc.vblock = 0;
+	return true;
+}
+
+// Index in fdc.crc_table of the sector at image offset, on the current track
+template <class G>
+unsigned char FDC<G>::track_slot(long offset)
+{
+	return (offset / GEOMETRY_BLOCK - G::track_block(fdc.track)) / G::blocks(G::zone(fdc.track));
+}
+
+// Background check: next block of the first sector of the track not
+// checked yet
+template <class G>
+void FDC<G>::check_sector()
+{
+	unsigned char	zone = G::zone(fdc.track),
+		n = G::sides * G::sectors(zone);
+
+	if (! track_crcs()) return;
+	while (fdc.vslot < n && (fdc.checked & (1UL << fdc.vslot)))
+	{
+		fdc.vslot++;
+		fdc.vblock = 0;
+	}
+	if (fdc.vslot >= n) return;
+
+	if (! fdc.vblock) mark_crc(check, 0xfb);
+	if (! read_block((long)(G::track_block(fdc.track) + fdc.vslot * G::blocks(zone) + fdc.vblock) * GEOMETRY_BLOCK))
+		fdc.vblock = G::blocks(zone);		// Unreadable: wrong as well
+	else
+		check.compute(buffer, FDC_BUFFER_SIZE);
+	if (++fdc.vblock < G::blocks(zone)) return;
+
+	if (fdc.vblock > G::blocks(zone) || (check.msb() << 8 | check.lsb()) != fdc.crc_table[fdc.vslot])
+		fdc.bad |= 1UL << fdc.vslot;
+	fdc.checked |= 1UL << fdc.vslot;
+}
+
+// The sector at fdc.offset was written whole: its CRC (crc) to the table.
+// The zone gets it when the command ends (write_crcs()), so the blocks of
+// its sectors go to the card without the zone in between.
+template <class G>
+void FDC<G>::store_crc()
+{
+	unsigned char	j = track_slot(fdc.offset);
+
+	if (! track_crcs()) return;
+	fdc.crc_table[j] = crc.msb() << 8 | crc.lsb();
+	fdc.checked |= 1UL << j;
+	fdc.bad &= ~(1UL << j);
+	if (j == fdc.vslot) fdc.vblock = 0;
+	fdc.newcrcs = true;
+}
+
+// The CRCs of crctrack to the zone if store_crc() changed any. The blocks
+// of the zone wait in the buffer like written ones.
+template <class G>
+void FDC<G>::write_crcs()
+{
+	unsigned long	at = G::image_size + CRCZONE_HEAD + 2UL * G::track_sector(fdc.crctrack);
+	unsigned char	i, n = G::sides * G::sectors(G::zone(fdc.crctrack));
+	unsigned int	k;
+
+	if (! fdc.newcrcs) return;
+	fdc.newcrcs = false;
+	for (i = 0; i < n; i++, at += 2)
+	{
+		k = at % FDC_BUFFER_SIZE;
+		if ((! i || ! k) && ! read_block(at - k))
+		{
+			set_status(FDC_ST_WRITEFAULT);
+			return;
+		}
+		buffer[k] = fdc.crc_table[i] >> 8;
+		buffer[k + 1] = fdc.crc_table[i];
+		fdc.dirty = at - k;
+	}
 }
 
 // ----------------------------------------------------------------------------
@@ -539,69 +1597,61 @@ void MB8877::cmd_forceint(char cmd)
 //	Side 1: [ 5 | 8 | 6 | 9 | 7 ]
 //	
 //	Track 80-159
-//	Side 0: [ 0 | 1 | 2 | 3 | 4 | 5 | 6 | 7 | 8 | 9 ]
-//	Side 1: [ 0 | 1 | 2 | 3 | 4 | 5 | 6 | 7 | 8 | 9 ]
-
-long	MB8877::locate()
+//	Side 0: [ 0 | 1 | 2 | 3 | 4 | 5 | 6 | 7 | 8 ]
+//	Side 1: [ 0 | 1 | 2 | 3 | 4 | 5 | 6 | 7 | 8 ]
+//
+//	The layout comes from the geometry G (see geometry.h): all offsets are
+//	multiples of 512 bytes, so locating a sector is a few compares, small
+//	multiplies and an add on the block number, folded by the compiler as
+//	far as the geometry allows.
+
+// Returns the image offset of the sector, or -1 if there is no such sector
+template <class G>
+long	FDC<G>::locate()
 {
-	long	offset=fdc.side * FDC_SIDE;	// Side offset
+	uint8_t	sector;
 
-	if(fdc.track<80)
-	{
-		offset += (fdc.track-1) * (unsigned int)FDC_SIZE_TRACK_0;	// # tracks below 80
-		switch(reg[SECTOR])
-		{
-			case 0:	
-			case 5: break;
-			case 3:	
-			case 8: offset+=FDC_SIZE_SECTOR_0;	break;
-			case 1:	
-			case 6: offset+=2*FDC_SIZE_SECTOR_0;	break;
-			case 4:	
-			case 9: offset+=3*FDC_SIZE_SECTOR_0;	break;
-			case 2:	
-			case 7: offset+=4*FDC_SIZE_SECTOR_0;	break;
-		}
-	}
-	else
-	{
-		// Number of tracks in each zone, minus the current track
-		offset += 80 * (unsigned int)FDC_SIZE_TRACK_0;		// 80 tracks of FDC_TRACK_SIZE_0
-		offset += (fdc.track-81) * (unsigned int)FDC_SIZE_TRACK_1;	// tracks above 80
-		offset += reg[SECTOR] * FDC_SIZE_SECTOR_1;
-	}
-	return offset;
+	if (fdc.track >= G::tracks) return -1;
+	sector = G::sector_block(G::zone(fdc.track), fdc.side, reg[SECTOR]);
+	if (sector == GEOMETRY_NOSECTOR) return -1;
+	return (long)(G::track_block(fdc.track) + sector) * GEOMETRY_BLOCK;
 }
 
 // ----------------------------------------------------------------------------
 // Decode the received command
 // ----------------------------------------------------------------------------
-void  MB8877::decode_command()
+template <class G>
+void  FDC<G>::decode_command()
 {
-#ifdef FDC_DEBUG
-  Serial.println("FDC Decoder");
-#endif
-  reg[STATUS] = FDC_ST_BUSY;      // We are BUSY
+  fdc.event = EVENT_NONE;         // FORCE INTERRUPT may replace a command in progress
+  fdc.cmd = reg[CMD];
+  fdc.started = time_qx1();
+  trace_event(TRACE_CMD, reg[DATA]);
 
   if (reg[STATUS] & FDC_ST_NOTREADY)    // Try again to open the directory
   {
-    scanSD();
-    scanDirectory(fdc.disk);
-    if (reg[STATUS] & FDC_ST_NOTREADY) return;  // Still no SD
+    scanSD();                   // Mounts and indexes the disks again
+    if (reg[STATUS] & FDC_ST_NOTREADY)  // Still no SD
+    {
+      finish();
+      return;
+    }
   }
-  
+  set_status(FDC_ST_BUSY);     // We are BUSY
   fdc.cmdtype = 0;  // Reset current command
+  fdc.primed = false;
+  fatReads();       // Count the FAT lookups of this command only
   
   switch(reg[CMD] & 0xf0) {     // Decode which command to execute
   // type I
     case 0x00: cmd_restore(FDC_CMD_RESTORE); break;
     case 0x10: cmd_seek(FDC_CMD_SEEK); break;
-    case 0x20: cmd_step(0); break;
-    case 0x30: cmd_step(1); break;
-    case 0x40: cmd_step(FDC_CMD_STEP_IN, 0); break;
-    case 0x50: cmd_step(FDC_CMD_STEP_IN, 1); break;
-    case 0x60: cmd_step(FDC_CMD_STEP_OUT, 0); break;
-    case 0x70: cmd_step(FDC_CMD_STEP_OUT, 1); break;
+    case 0x20:
+    case 0x30: cmd_step(); break;
+    case 0x40:
+    case 0x50: fdc.vector = false; cmd_step(); break;
+    case 0x60:
+    case 0x70: fdc.vector = true; cmd_step(); break;
   // type II
     case 0x80: cmd_readdata(FDC_CMD_RD_SEC); break;
     case 0x90: cmd_readdata(FDC_CMD_RD_MSEC); break;
@@ -613,74 +1663,9 @@ void  MB8877::decode_command()
     case 0xf0: cmd_writetrack(FDC_CMD_WR_TRK); break;
   // type IV
     case 0xd0: cmd_forceint(FDC_CMD_TYPE4); break;
-    default: break;
+    default: finish(); break;
   }
-  digitalWrite(FDC_IRQ, LOW);   // Generate interrupt, command completed
-}
-
-// ----------------------------------------------------------------------------
-// Send a byte to the QX1 via DAL
-// ----------------------------------------------------------------------------
-
-void send_qx1(unsigned char byte)
-{
-	DDRD = 0xff;					// Set PORT D as output
-
-	PORTC &= 0xf0;
-	PORTC |= BUS_SELECT_DATA;			// Select the bus
-
-	PORTD = byte;					// Write the byte
-
-	PORTC &= 0xf0;
-	PORTC |= BUS_SELECT_ADDRESS;			// Latch the bus
-
-	DDRD = 0x00;					// Set PORT D as input
-
-	digitalWrite(INT0, HIGH); 			// Activate internal pullup resistor
-	attachInterrupt(0, read_qx1, FALLING);		// Declare interrupt routine
-	digitalWrite(FDC_DRQ, LOW);			// Fire DRQ Interrupt
-	__asm__("nop\n\t""nop\n\t");			// Waits ~ 125 nsec
-	if(qx1bus == 0xff)
-		mb8877.reg[STATUS] |= FDC_ST_LOSTDATA;	// QX1 did not load DATA in time
-	else
-		mb8877.reg[STATUS] &= ~FDC_ST_LOSTDATA;	// QX1 got DATA in time
 }
 
-// ----------------------------------------------------------------------------
-// We've got an interrupt. We scan /RD, /WR, A0 and A1 to determine what is
-// requested.
-//
-//    X   X   X   X  A1  A0 /WR /RD         MPU wants to ...
-//  ---+---+---+---+---+---+---+---+------+---------------------------
-//   -   -   -   -   0   0   0   1 | 0x01 | write to reg[CMD]
-//   -   -   -   -   0   0   1   0 | 0x02 | read reg[STATUS]
-//   -   -   -   -   0   1   0   1 | 0x05 | write to reg[TRACK]
-//   -   -   -   -   0   1   1   0 | 0x06 | read reg[TRACK]
-//   -   -   -   -   1   0   0   1 | 0x09 | write to reg[SECTOR]
-//   -   -   -   -   1   0   1   0 | 0x0a | read reg[SECTOR]
-//   -   -   -   -   1   1   0   1 | 0x0d | write to reg[DATA]
-//   -   -   -   -   1   1   1   0 | 0x0e | read reg[DATA]
-//
-// All other values are impossible to occur.
-// ----------------------------------------------------------------------------
-
-void read_qx1() {
-	qx1bus=(PORTD & 0x0f); 		// Get value
-	PORTC &= 0xf0;
-	PORTC |= BUS_SELECT_DATA;	// Prepare bus to get data
-
-  switch(qx1bus)
-  {
-    // QX1 MPU wants to write to a register; we get the value from PORTD
-    case 0x01: mb8877.reg[CMD] = PORTD; mb8877.decode_command(); break;
-    case 0x05: mb8877.reg[TRACK] = PORTD; break;
-    case 0x09: mb8877.reg[SECTOR] = PORTD; break;
-    case 0x0d: mb8877.reg[DATA] = PORTD; break;
-
-    // QX1 MPU wants to read from a register; we serve the value on PORTD
-    case 0x02: PORTD = mb8877.reg[STATUS]; break;
-    case 0x06: PORTD = mb8877.reg[TRACK]; break;
-    case 0x0a: PORTD = mb8877.reg[SECTOR]; break;
-    case 0x0e: PORTD = mb8877.reg[DATA]; break;
-  }
-}
+// The controller of this build
+template class FDC<FDC_GEOMETRY>;
@@ -17,6 +17,10 @@
 #ifndef _H_MB8877
 #define _H_MB8877
 
+#include "hal.h"
+#include "crc.h"
+#include "geometry.h"
+
 // MB8877 variables
 #define FDC_ST_BUSY		0x01	// busy
 #define FDC_ST_INDEX		0x02	// index hole
@@ -70,6 +74,39 @@
 #define FDC_EXTRA_DELAY		15000
 #define FDC_SEEK_FORWARD	true
 #define	FDC_SEEK_BACKWARD	!FDC_SEEK_FORWARD
+#define FDC_BUFFER_SIZE		512	// Sector buffer: one SD card block
+#define FDC_EXTENTS		8	// Runs of card blocks an image may be mapped with
+#define FDC_LOST_TIMEOUT	10000	// us the MPU has to answer a DRQ before LOSTDATA
+#define FDC_FIFO_SIZE		32	// Bytes between the sector buffer and the bus interrupt (power of 2)
+#define FDC_NOTRACK		0xff	// No track
+#define FDC_AHEAD_STREAK	2	// Tracks read one after the other before reading ahead
+
+// What a transfer is made of
+#define FIELD_DATA		0	// Sector data, through the sector buffer
+#define FIELD_BYTES		1	// fdc.id (ID field, CRC)
+#define FIELD_FILL		2	// fdc.fill repeated (gaps, sync, marks)
+
+// Statistics (see FDC::stats), kept per kind of command
+#define STAT_KINDS		11	// RESTORE, SEEK, STEP (all), then 0x80-0xf0 by high nibble
+
+struct fdcstat {
+  unsigned int  count;		// Commands run
+  unsigned long min, max, total;	// Latency, time_qx1() from CMD written to BUSY down (us)
+};
+
+struct fdcstats {
+  struct fdcstat  kind[STAT_KINDS];
+  unsigned long bytes;		// Moved through DATA
+  unsigned int  underruns,	// DRQ raised again after the MPU emptied the FIFO
+    lostdata,			// Type II/III commands ending with each error
+    crcerr,
+    recnfnd,
+    writefault,
+    retries,			// Card blocks read a second time after a failed read
+    blank,			// Sectors sent from the fill byte of a sparse image
+    hits,			// Blocks read ahead (read_ahead()) the MPU then asked for
+    misses;			// and dropped unused
+};
 
 /* FDC emulation control:
 Bit 7  6  5  4  3  2  1  0
@@ -85,36 +122,154 @@ Bit 7  6  5  4  3  2  1  0
   (If I0-I3 are 0: don't issue any interrupt, but still abort the current command). 
  */
       
-class  MB8877 {
+// The controller, for disks of geometry G (see geometry.h)
+template <class G> class FDC {
+  static_assert(G::sides * G::max_sectors <= 32, "a track has more sectors than fdc.checked has bits");
   struct {
     char control,  
-      cmdtype,  // Command type
-      track;    // Current track (might be != reg[TRACK])
+      cmdtype;  // Command type
+    unsigned char track;  // Current track (might be != reg[TRACK])
     unsigned int  position, // Current position on sector
       side,    // Current side
       disk;   // Current disk
     bool  vector,   // Previous step direction
-      seek;   // Seek selected
+      seek,   // Seek selected
+      writing,  // The field comes from the MPU
+      primed;   // DRQ already raised by this command
+    volatile bool pending, // CMD written by the MPU, not decoded yet
+      drq;    // DRQ raised: a byte waits in DATA (read), or room in the FIFO (write)
+    volatile unsigned char head,  // FIFO: next byte put in
+      tail,     // FIFO: next byte taken out
+      acks;     // DATA accesses served, wrapping
+    unsigned char seen;  // acks when transfer() last looked
+    volatile unsigned int expect; // Write: bytes the MPU has still to send
+    unsigned char cmd,  // Command in progress
+      event,    // Where it stands (EVENT_*)
+      target,   // Track a type I command steps to
+      last,     // Sector following the last one of a type II command
+      phase,    // READ TRACK: run of track_template being sent; WRITE TRACK: FORMAT_*
+      slot,     // READ TRACK: sector being sent, in rotation order
+      field,    // What the transfer is made of (FIELD_*)
+      fill,     // Byte of a FIELD_FILL
+      id[6];    // Bytes of a FIELD_BYTES
+    unsigned int  count;  // Bytes in the field
+    unsigned int  at;   // WRITE TRACK: bytes of the ID or data field taken so far
+    unsigned long formatted;  // WRITE TRACK: sectors of the track whose data field came, in image order
+    bool  formatting; // WRITE TRACK under way: end_format() still to come
+    unsigned long since;  // time_qx1() of the last DRQ raised or answered
+    unsigned long started;  // time_qx1() when the command was taken
+    long  offset; // Image offset of the current sector
+    struct extent map[FDC_EXTENTS]; // Card blocks of the image
+    unsigned char extents;  // Runs in map (0: not mapped, go through FAT)
+    unsigned char header; // Card blocks ahead of the sector data (see image.h)
+    unsigned long stream; // Next block of the open multi-block read (0: no stream)
+    unsigned int  loaded; // Bytes of that block in the buffer so far (FDC_BUFFER_SIZE: whole)
+    unsigned long wstream;  // Next block of the open multi-block write (0: no write)
+    long  ahead;  // Image offset of the block read ahead into the buffer (-1: none)
+    unsigned char lastread, // Track of the last type II read (FDC_NOTRACK: none)
+      streak,   // Tracks read one after the other up to lastread
+      predicted;  // lastread when the next track was last read ahead
+    long  dirty;  // Image offset of the block waiting in the buffer (-1: none)
+    bool  crcs;   // The image has a CRC zone (see crczone.h)
+    unsigned char crctrack, // Track whose CRCs are in crc_table (FDC_NOTRACK: none)
+      vslot,    // Background check: sector of the track being checked
+      vblock;   // and its next block
+    unsigned long checked,  // Sectors of crctrack checked against their CRC
+      bad;      // and found wrong
+    uint16_t  crc_table[G::sides * G::max_sectors]; // CRCs of crctrack, in image order
+    bool  newcrcs;  // Entries of crc_table not in the zone yet (see write_crcs())
+    bool  sparse; // The header tells which sectors hold data (see image.h)
+    unsigned char blank,  // Byte of those which do not
+      usedtrack;  // Track whose bits are in used (FDC_NOTRACK: none)
+    unsigned long used; // Sectors of usedtrack holding data, in image order
+    bool  newused;  // used differs from the header (WRITE TRACK, see end_format())
   } fdc;
   public:
-    MB8877();
-    ~MB8877();
-    char reg[5];
+    typedef G Geometry;
+    FDC();
+    ~FDC();
+    volatile unsigned char reg[5];	// Shared with the bus interrupt
+    unsigned int  fatreads;	// FAT lookups of the last command
+    struct fdcstats stats;	// Since power up or the last reset_stats()
+    static unsigned char stat_kind(unsigned char);	// Index in stats.kind of a command
+    void  command(void);
+    void  served(void);
+    void  step(void);
     void  decode_command();
     long  locate(void);
-    void  vdisk(void);
+    void  insert(int);
+    int   number(void);
     void  cmd_restore(int);
     void  cmd_seek(char);
-    void  cmd_step(bool);
-    void  cmd_step(char, bool);
+    void  cmd_step(void);
     void  cmd_readdata(char);
     void  cmd_writedata(char);
     void  cmd_readaddr(char);
     void  cmd_readtrack(char);
     void  cmd_writetrack(char);
     void  cmd_forceint(char);
+    void  reset_stats(void);
   private:
-} mb8877;
+    unsigned char buffer[FDC_BUFFER_SIZE];	// Sector buffer, filled one SD block at a time
+    volatile unsigned char fifo[FDC_FIFO_SIZE];	// Bytes on their way to or from DATA
+    CRC   crc;					// CRC of the field in progress
+    CRC   check;				// CRC of the sector checked in the background
+    void  finish(void);
+    void  raise_drq(void);
+    void  drop_drq(void);
+    void  set_status(unsigned char);
+    void  clear_status(unsigned char);
+    void  trace_event(unsigned char, unsigned char);
+    void  count_command(void);
+    void  seek_track(void);
+    void  end_seek(void);
+    void  search(void);
+    void  transfer(void);
+    bool  burst(unsigned char);
+    void  next_field(void);
+    bool  track_field(void);
+    bool  chain_field(void);
+    void  open_sector(void);
+    void  id_field(unsigned char, unsigned char);
+    void  open_field(unsigned char, unsigned int);
+    void  start_field(unsigned char, unsigned int);
+    void  interrupt(void);
+    void  lost(void);
+    unsigned long map_block(unsigned int);
+    bool  read_block(long, bool = true);
+    unsigned char open_image(void);
+    bool  read_header(void);
+    bool  track_used(unsigned char);
+    bool  blank_sector(void);
+    bool  mark_used(void);
+    bool  write_used(void);
+    bool  format_byte(unsigned char);
+    long  format_id(void);
+    bool  format_sector(void);
+    bool  format_used(void);
+    bool  fill_blocks(unsigned char, unsigned char, bool);
+    void  end_format(void);
+    bool  open_crcs(void);
+    bool  track_crcs(void);
+    unsigned char track_slot(long);
+    void  check_sector(void);
+    void  store_crc(void);
+    void  write_crcs(void);
+    bool  seek_block(long);
+    bool  seek_file(long);
+    int   fill_buffer(bool = true);
+    bool  load_chunk(unsigned int);
+    bool  read_ahead(void);
+    void  drop_ahead(void);
+    void  finish_block(void);
+    bool  flush_buffer(void);
+    unsigned int write_run(long);
+    bool  write_block(long);
+    void  stop_stream(void);
+};
+
+typedef FDC<FDC_GEOMETRY> MB8877;
+extern MB8877 mb8877;
 
 /* ------------------------------------------------
 	FDC section
@@ -150,14 +305,15 @@ Type	Command         b7 b6 b5 b4 b3 b2 b1 b0
 ------------------------------------------------ */
 
 
-// ----- Events
-#define EVENT_SEEK    0
-#define EVENT_SEEKEND   1
-#define EVENT_SEARCH    2
-#define EVENT_TYPE4   3
-#define EVENT_MULTI1    4
-#define EVENT_MULTI2    5
-#define EVENT_LOST    6
+// ----- Events: where the command in progress stands (see MB8877::step())
+#define EVENT_SEEK    0   // Type I: head moving, one track per step
+#define EVENT_SEEKEND   1   // Type I: head on the target track, verify and end
+#define EVENT_SEARCH    2   // Type II: look for the next sector
+#define EVENT_TYPE4   3   // FORCE INTERRUPT: abort the command in progress
+#define EVENT_MULTI1    4   // Transfer of a field, one byte per DRQ
+#define EVENT_MULTI2    5   // End of a field: next sector, next field or end
+#define EVENT_LOST    6   // The MPU did not answer a DRQ in time
+#define EVENT_NONE    7   // No command in progress
 
 void scanSD();
 
@@ -0,0 +1,56 @@
+/*
+  Yamaha QX1 floppy drive emulator
+
+  Francois Basquin, 2014 mar 20
+
+  QX1 bus lines at the port level. Each line is a type whose port and mask
+  are compile time constants, so driving it compiles to a single sbi/cbi
+  and the bus to in/out, with none of the pin table lookups and interrupt
+  masking of digitalWrite(). Ports are given by their ATmega328 I/O address,
+  the one sbi, cbi, in and out take; DDRx and PORTx follow PINx.
+*/
+
+#ifndef _H_PINS
+#define _H_PINS
+
+#include <stdint.h>
+#include <avr/io.h>
+
+#include "qx1.h"
+
+#define IO_PINC		0x06
+#define IO_PIND		0x09
+
+// One output line
+template <uint8_t pin, uint8_t bit> struct OutPin {
+	static constexpr uint8_t mask = 1 << bit;
+	static inline void output() { _SFR_IO8(pin + 1) |= mask; }
+	static inline void high() { _SFR_IO8(pin + 2) |= mask; }	// sbi
+	static inline void low() { _SFR_IO8(pin + 2) &= ~mask; }	// cbi
+};
+
+// Output lines driven together, the other lines of the port untouched
+template <uint8_t pin, uint8_t bits> struct OutField {
+	static constexpr uint8_t mask = bits;
+	static inline void output() { _SFR_IO8(pin + 1) |= mask; }
+	static inline void write(uint8_t v) { _SFR_IO8(pin + 2) = (_SFR_IO8(pin + 2) & ~mask) | v; }
+};
+
+// A whole port, driven only while it serves a read; as an input, the lines
+// of pullups keep their pull-up
+template <uint8_t pin, uint8_t pullups = 0> struct IoPort {
+	static inline void output() { _SFR_IO8(pin + 1) = 0xff; }
+	static inline void input() {
+		_SFR_IO8(pin + 1) = 0x00;
+		_SFR_IO8(pin + 2) = pullups;
+	}
+	static inline uint8_t read() { return _SFR_IO8(pin); }		// in
+	static inline void write(uint8_t v) { _SFR_IO8(pin + 2) = v; }	// out
+};
+
+typedef IoPort<IO_PIND, 1 << PD2> Bus;		// PORTD, what BusSelect routes to it (see qx1.h); PD2 is INT0
+typedef OutField<IO_PINC, 0x03>	BusSelect;	// PC0-1: U4A select, BUS_SELECT_*
+typedef OutPin<IO_PINC, 2>	IrqPin;		// PC2: FDC_IRQ, active high
+typedef OutPin<IO_PINC, 3>	DrqPin;		// PC3: FDC_DRQ, active low
+
+#endif
@@ -19,16 +19,20 @@
 
 // These parameters are specific to the Yamaha QX1
 //	Track format=ISOIBM_MFM_ENCODING
-//	2 sides, 160 tracks/side (775072 bytes/side)
-//	The first byte on each sector is Data Address Mark (i.e. not a data byte)
-//	zone 0 (track 0 to 39):   819200 bytes (5 sectors/track * 2 sides, 1024 bytes/sector = 10240 bytes/track)
-//	zone 1 (track 40 to 79): 728064 bytes (9 sectors/track * 2 sides, 512 bytes/sector = 9216 bytes/track)
-//	zone CRC: 2444 bytes (2 bytes / sector)
-//	1550144 bytes/disk
+//	2 sides, 160 tracks/side
+//	zone 0 (track 0 to 79):   819200 bytes (5 sectors/track * 2 sides, 1024 bytes/sector = 10240 bytes/track)
+//	zone 1 (track 80 to 159): 737280 bytes (9 sectors/track * 2 sides, 512 bytes/sector = 9216 bytes/track)
+//	1556480 bytes/disk
+//
+//	Image layout: tracks follow each other from track 0; each track holds
+//	side 0 then side 1, and each side holds its sectors in the order they
+//	pass under the head (see MB8877::locate()). Every sector starts on a
+//	512 bytes boundary.
 
 #define FDC_DISKS		99	// Virtual disks per SD card
-#define FDC_TRACKS		80	// Tracks per disk (from Canon MF-221 datasheet)
-#define FDC_SIDE		775072	// Bytes per side
+#define FDC_TRACKS		160	// Tracks per side
+#define FDC_ZONE_TRACKS		80	// Tracks per zone
+#define FDC_IMAGE_SIZE		1556480	// Bytes per disk image
 #define FDC_SIZE_TRACK_0	10240	// Bytes per track, zone 0
 #define FDC_SIZE_TRACK_1	9216	// Bytes per track, zone 1
 #define FDC_SIZE_SECTOR_0	1024	// Bytes per sector, zone 0
@@ -80,8 +84,6 @@
 // DECLARE FUNCTION
 // ----------------------------------------------------------------------------
 void readsector();  
-void send_qx1(unsigned char);
-void read_qx1();
 void fdcdisplay(char*);
 
 #define TRUE  1
@@ -1,30 +1,186 @@
-/* Yamaha QX1 floppy drive emulator
- Francois Basquin, 2014 mar 20
-References Arduino Mini: http://arduino.cc/en/Main/ArduinoBoardMini SD library: http://www.roland-riegel.de/sd-reader/index.html MicroFAT: http://arduinonut.blogspot.ca/2008/04/ufat.html CRC: http://stackoverflow.com/questions/17196743/crc-ccitt-implementation mb8877a: from RetroPC ver 2006.12.06 by Takeda.Toshiya, http://homepage3.nifty.com/takeda-toshiya/ Fujitsu MB8877a datasheet: map.grauw.nl/resources/disk/fujitsu_mb8876a.pdf Interrupts: https://thewanderingengineer.com/2014/08/11/arduino-pin-change-interrupts/
-*/#define FDC_DEBUG
-#define PORT_INPUT  0x00#define PORT_OUTPUT 0xff#define BUS_SELECT(d) { PORTC &= 0xf0; PORTC |= d; }
-unsigned char format_tracks, format_sectors;  // These are values provided by MPU
-#include <avr/io.h>#include <avr/interrupt.h>
-#include "mb8877.h"#include "sdcard.h"/* #include <ewents.h> *//*#include "mb8877.cpp"*//*#include "sdcard.cpp"*/#ifndef _H_QX1#include "qx1.h"#endif
-// This variable will get data from the QX1 data busvolatile char qx1bus;
-// ----------------------------------------------------------------------------// Arduino setup routine// ----------------------------------------------------------------------------
-void setup() {  Serial.begin(9600);  Serial.println("00 FDC init..");
-  // ----- Set ports  // Port D is the bus; input or output  // Port C:0-1 drive the 74139 to manage the digital bus; always outputs  // Port C:2-3 drive the interrupts; always outputs
-  DDRD = PORT_INPUT;  // Set port D as input  DDRC |= 0x0f;       // Set port C (0-3) as output  qx1bus=0;           // no data on QX1 bus
-  Serial.println("01 Card init..");
-  pinMode(SD_CHIP_SELECT_PIN, OUTPUT);  digitalWrite(SD_CHIP_SELECT_PIN, HIGH);   // Activate Pullup resistor
-  scanSD();                 // If SD card is present ...  scanDirectory(1);  // ... scan the directory}
-void fdcdisplay(){  const char *cmdstr[0x10] = {    "  I Seek track 0",    "  I Seek",    "  I Step",    "  I Step",    "  I Step In",    "  I Step In",    "  I Step Out",    "  I Step Out",    " II Read One Sector",    " II Read Multiple Sector",    " II Write One Sector",    " II Write Multiple Sector",    "III Read Address",    " IV Force interrupt ",    "III Read Track",    "III Write Track"};
-  Serial.print("Reg[CMD]="); Serial.println(mb8877.reg[CMD]);  Serial.print("Reg[DATA]="); Serial.println(mb8877.reg[DATA]);  Serial.print("Reg[TRACK]="); Serial.println(mb8877.reg[TRACK]);  Serial.print("Reg[SECTOR]="); Serial.println(mb8877.reg[SECTOR]);  Serial.println(cmdstr[mb8877.reg[CMD] >> 4]);
-  Serial.println("Status register");  Serial.print("      Not ready: "); Serial.println(!(mb8877.reg[STATUS] & 0x80) ? 'X' : ' ');  Serial.print("Write protected: "); Serial.println(!(mb8877.reg[STATUS] & 0x40) ? 'X' : ' ');  Serial.print("    Head loaded: "); Serial.println(!(mb8877.reg[STATUS] & 0x20) ? 'X' : ' ');  Serial.print("     Seek error: "); Serial.println(!(mb8877.reg[STATUS] & 0x10) ? 'X' : ' ');  Serial.print("      CRC error: "); Serial.println(!(mb8877.reg[STATUS] & 0x08) ? 'X' : ' ');  Serial.print("        Track 0: "); Serial.println(!(mb8877.reg[STATUS] & 0x04) ? 'X' : ' ');  Serial.print("     Index hole: "); Serial.println(!(mb8877.reg[STATUS] & 0x02) ? 'X' : ' ');  Serial.print("           Busy: "); Serial.println(!(mb8877.reg[STATUS] & 0x01) ? 'X' : ' ');}
-void bus_request(){ qx1bus = PORTD;}
-void serve_request(int s, int r){ detachInterrupt(digitalPinToInterrupt(2)); detachInterrupt(digitalPinToInterrupt(3));
- BUS_SELECT(BUS_SELECT_DATA);
- if (s==0)  mb8877.reg[r] = PORTD; else  PORTD = mb8877.reg[r];
- fdcdisplay();
- digitalWrite(FDC_DRQ, HIGH); // Data present digitalWrite(FDC_IRQ, HIGH); // Command completed
- BUS_SELECT(BUS_SELECT_ADDRESS);
- attachInterrupt(digitalPinToInterrupt(2),bus_request, LOW); attachInterrupt(digitalPinToInterrupt(3),bus_request, LOW);}
-void loop(){  int lock=FALSE;  int incomingByte; // DEBUG
- switch(qx1bus) {  case 0x04: serve_request(0, STATUS); break;  case 0x05: serve_request(0, TRACK); break;  case 0x06: serve_request(0, SECTOR); break;  case 0x07: serve_request(0, DATA); break;  case 0x08: serve_request(1, COMMAND); break;  case 0x09: serve_request(1, TRACK); break;  case 0x0a: serve_request(1, SECTOR); break;  case 0x0b: serve_request(1, DATA); break; } qx1bus = 0;
-// DEBUG ---- if (Serial.available() > 0) {  // read the incoming byte:  incomingByte = Serial.read();   switch(incomingByte)  {   case 'O': if(lock){Serial.println("OPEN");} break;   case '>':   case '+': if(!lock){Serial.println(">"); scanDirectory(1);} break;   case '<':   case '-': if(!lock){Serial.println("<"); scanDirectory(-1);} break;   case '0': if(!lock){Serial.println("<<"); scanDirectory(0);} break;   case '.': if(!lock){Serial.println(">>"); scanDirectory(999);} break;   case ' ': lock=!lock; break;  } }// ---- DEBUG}
+/*
+ Yamaha QX1 floppy drive emulator
+
+ Francois Basquin, 2014 mar 20
+
+ References
+ Arduino Mini: http://arduino.cc/en/Main/ArduinoBoardMini
+ SD library: http://www.roland-riegel.de/sd-reader/index.html
+ MicroFAT: http://arduinonut.blogspot.ca/2008/04/ufat.html
+ CRC: http://stackoverflow.com/questions/17196743/crc-ccitt-implementation
+ mb8877a: from RetroPC ver 2006.12.06 by Takeda.Toshiya, http://homepage3.nifty.com/takeda-toshiya/
+ Fujitsu MB8877a datasheet: map.grauw.nl/resources/disk/fujitsu_mb8876a.pdf
+ Interrupts: https://thewanderingengineer.com/2014/08/11/arduino-pin-change-interrupts/
+*/
+
+unsigned char format_tracks, format_sectors;	// These are values provided by MPU
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "mb8877.h"
+#include "sdcard.h"
+#include "hal.h"
+#include "trace.h"
+/* #include <ewents.h> */
+/*#include "mb8877.cpp"*/
+/*#include "sdcard.cpp"*/
+#ifndef _H_QX1
+#include "qx1.h"
+#endif
+
+// This variable will get data from the QX1 data bus
+volatile char qx1bus;
+
+// Cost of the DATA accesses, timed by the bus interrupt (hal_avr.cpp)
+extern volatile unsigned long bus_cycles;
+extern volatile unsigned int bus_bytes, bus_worst;
+
+// RAM layout from the linker, and the stack margin (hal_avr.cpp)
+extern uint8_t __data_start, __data_end, __bss_start, __bss_end;
+extern unsigned int ram_unused(void), ram_free(void);
+
+// ----------------------------------------------------------------------------
+// Arduino setup routine
+// ----------------------------------------------------------------------------
+void setup() {
+  Serial.begin(9600);
+  Serial.println(F("00 FDC init.."));
+
+  // ----- Set ports
+  // Port D is the bus; input or output
+  // Port C:0-1 drive the 74139 to manage the digital bus; always outputs
+  // Port C:2-3 drive the interrupts; always outputs
+
+  begin_qx1();			// Bus lines, and the bus interrupt from now on
+  qx1bus=0;			// no data on QX1 bus
+
+  Serial.println(F("01 Card init.."));
+
+  pinMode(SD_CHIP_SELECT_PIN, OUTPUT);
+  digitalWrite(SD_CHIP_SELECT_PIN, HIGH);	// Activate Pullup resistor
+
+  scanSD();					// If SD card is present ...
+  mb8877.insert(findDisk(1, 1));		// ... insert the first disk
+}
+
+void fdcdisplay(char *cmdstr) {
+  Serial.print(F("Reg[CMD]=")); Serial.println(mb8877.reg[CMD]);
+  Serial.print(F("Reg[DATA]=")); Serial.println(mb8877.reg[DATA]);
+  Serial.print(F("Reg[TRACK]=")); Serial.println(mb8877.reg[TRACK]);
+  Serial.print(F("Reg[SECTOR]=")); Serial.println(mb8877.reg[SECTOR]);
+  Serial.println(cmdstr);
+
+  Serial.println(F("Status register"));
+  Serial.print(F("      Not ready: ")); Serial.println(!(mb8877.reg[STATUS] & 0x80) ? 'X' : ' ');
+  Serial.print(F("Write protected: ")); Serial.println(!(mb8877.reg[STATUS] & 0x40) ? 'X' : ' ');
+  Serial.print(F("    Head loaded: ")); Serial.println(!(mb8877.reg[STATUS] & 0x20) ? 'X' : ' ');
+  Serial.print(F("     Seek error: ")); Serial.println(!(mb8877.reg[STATUS] & 0x10) ? 'X' : ' ');
+  Serial.print(F("      CRC error: ")); Serial.println(!(mb8877.reg[STATUS] & 0x08) ? 'X' : ' ');
+  Serial.print(F("        Track 0: ")); Serial.println(!(mb8877.reg[STATUS] & 0x04) ? 'X' : ' ');
+  Serial.print(F("     Index hole: ")); Serial.println(!(mb8877.reg[STATUS] & 0x02) ? 'X' : ' ');
+  Serial.print(F("           Busy: ")); Serial.println(!(mb8877.reg[STATUS] & 0x01) ? 'X' : ' ');
+}
+
+// Cycles per transferred byte, average and worst, since the last call
+void cycles() {
+  unsigned long total;
+  unsigned int bytes, worst;
+
+  cli();
+  total = bus_cycles; bytes = bus_bytes; worst = bus_worst;
+  bus_cycles = 0; bus_bytes = bus_worst = 0;
+  sei();
+  Serial.print(F("Cycles/byte: ")); Serial.print(bytes ? total / bytes : 0);
+  Serial.print(F(" max ")); Serial.print(worst);
+  Serial.print(F(" over ")); Serial.println(bytes);
+}
+
+// RAM budget: variables, then what the stack has left at its deepest so far
+void ram() {
+  Serial.print(F(".data ")); Serial.print(&__data_end - &__data_start);
+  Serial.print(F(" .bss ")); Serial.print(&__bss_end - &__bss_start);
+  Serial.print(F(" stack+free ")); Serial.print(ram_free());
+  Serial.print(F(" never used ")); Serial.println(ram_unused());
+}
+
+// Command statistics (mb8877.stats): count and min/avg/max latency in us per
+// kind of command, then the error counters. Only loop() touches them.
+// Names in flash, as every string of the console.
+static const char kind_0[] PROGMEM = "RESTORE", kind_1[] PROGMEM = "SEEK", kind_2[] PROGMEM = "STEP",
+  kind_3[] PROGMEM = "READ SECTOR", kind_4[] PROGMEM = "READ MULTIPLE", kind_5[] PROGMEM = "WRITE SECTOR",
+  kind_6[] PROGMEM = "WRITE MULTIPLE", kind_7[] PROGMEM = "READ ADDRESS", kind_8[] PROGMEM = "FORCE INT",
+  kind_9[] PROGMEM = "READ TRACK", kind_10[] PROGMEM = "WRITE TRACK";
+static const char *const kinds[STAT_KINDS] PROGMEM = {
+  kind_0, kind_1, kind_2, kind_3, kind_4, kind_5, kind_6, kind_7, kind_8, kind_9, kind_10
+};
+
+void stats(bool reset) {
+  struct fdcstats *s = &mb8877.stats;
+  int i;
+
+  for (i = 0; i < STAT_KINDS; i++) {
+    if (!s->kind[i].count) continue;
+    Serial.print((const __FlashStringHelper*)pgm_read_word(&kinds[i])); Serial.print(F(": ")); Serial.print(s->kind[i].count);
+    Serial.print(F(" min ")); Serial.print(s->kind[i].min);
+    Serial.print(F(" avg ")); Serial.print(s->kind[i].total / s->kind[i].count);
+    Serial.print(F(" max ")); Serial.println(s->kind[i].max);
+  }
+  Serial.print(F("Bytes: ")); Serial.print(s->bytes);
+  Serial.print(F(" blank sectors: ")); Serial.println(s->blank);
+  Serial.print(F("Read-ahead hits: ")); Serial.print(s->hits);
+  Serial.print(F(" misses: ")); Serial.println(s->misses);
+  Serial.print(F("Underruns: ")); Serial.print(s->underruns);
+  Serial.print(F(" lost data: ")); Serial.print(s->lostdata);
+  Serial.print(F(" CRC: ")); Serial.print(s->crcerr);
+  Serial.print(F(" not found: ")); Serial.print(s->recnfnd);
+  Serial.print(F(" write fault: ")); Serial.print(s->writefault);
+  Serial.print(F(" SD retries: ")); Serial.println(s->retries);
+  if (reset) mb8877.reset_stats();
+}
+
+// Trace records to the console, as far as the serial buffer takes them
+void drain() {
+  struct trace t;
+
+  while (Serial.availableForWrite() > (int)sizeof(t) && traceRead(&t)) {
+    Serial.write(TRACE_SYNC);
+    Serial.write((const uint8_t*)&t, sizeof(t));
+  }
+}
+
+// Change disk, keep the current one if there is none in that direction
+void select(int n) {
+  if (n >= 0) mb8877.insert(n);
+}
+
+void loop() {
+  static int lock=FALSE;
+  int incomingByte;	// DEBUG
+
+  mb8877.step();	// Run the FDC command in progress; the bus interrupt serves the registers
+  drain();		// Trace log to the console (host/qx1trace decodes it)
+
+  // DEBUG ----
+  if (Serial.available() > 0) {
+    // read the incoming byte:
+    incomingByte = Serial.read();
+
+    switch(incomingByte)
+    {
+      case 'O': if(lock){Serial.println(F("OPEN"));} break;
+      case '>':
+      case '+': if(!lock){Serial.println(F(">")); select(findDisk(mb8877.number()+1, 1));} break;
+      case '<':
+      case '-': if(!lock){Serial.println(F("<")); select(findDisk(mb8877.number()-1, -1));} break;
+      case '0': if(!lock){Serial.println(F("<<")); select(findDisk(0, 1));} break;
+      case '.': if(!lock){Serial.println(F(">>")); select(findDisk(FDC_DISKS, -1));} break;
+      case 'c': cycles(); break;
+      case 'm': ram(); break;
+      case 's': stats(false); break;
+      case 'S': stats(true); break;
+      case 'r': fdcdisplay((char*)"Registers"); break;
+      case ' ': lock=!lock; break;
+    }
+  }
+  // ---- DEBUG
+}
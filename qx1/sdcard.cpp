@@ -12,59 +12,440 @@ References
   Fujitsu MB8877a datasheet: map.grauw.nl/resources/disk/fujitsu_mb8876a.pdf
 */
 
+#include <avr/io.h>
+#include <avr/eeprom.h>
+
 #include "sdcard.h"
+#include "mb8877.h"
 #include "qx1.h"
+#include "hal.h"
+#include "slots.h"
+#include "crczone.h"
+#include "image.h"
+
+// SD commands and tokens used by the multi-block stream and write
+#define SD_CMD12	0x0C	// STOP_TRANSMISSION
+#define SD_CMD18	0x12	// READ_MULTIPLE_BLOCK
+#define SD_CMD23	0x17	// SET_WR_BLK_ERASE_COUNT (ACMD23, after CMD55)
+#define SD_CMD25	0x19	// WRITE_MULTIPLE_BLOCK
+#define SD_CMD55	0x37	// APP_CMD
+#define SD_DATA_START	0xFE	// Start token of a data block
+#define SD_WRITE_START	0xFC	// Start token of a block of WRITE_MULTIPLE_BLOCK
+#define SD_STOP_TRAN	0xFD	// Stop token of WRITE_MULTIPLE_BLOCK
+#define SD_DATA_ACCEPTED	0x05	// Data response token: block taken
+#define SD_BUSY_TIMEOUT	600	// ms a card may stay busy programming blocks
+#define SD_BLOCK_SIZE	512
+
+Sd2Card   card;
+SdVolume  volume;
+SdFile    root;
+
+// Virtual disk index: presence bitmap in RAM, directory entry and first
+// cluster of each image in EEPROM (see indexDisks())
+struct diskentry {
+  uint16_t  index;    // Entry number in the root directory
+  uint32_t  cluster;  // First cluster
+};
+
+static uint8_t  disks[FDC_DISKS/8 + 1];
+static struct diskentry EEMEM eedisks[FDC_DISKS + 1];
+
+// Slot card (see slots.h): block of disk 0 and blocks per slot, 0 for FAT
+static uint32_t slotFirst, slotStride;
+
+static unsigned int fatLinks;   // FAT lookups since the last fatReads()
+static uint16_t streamLeft;     // Bytes of the stream block still to read
+
+static void indexDisks(void);
+static bool readSlots(void);
+
+// ----------------------------------------------------------------------------
+//	Scan the SD card and open the volume
+//	Set reg[STATUS] to FDC_ST_NOTREADY if no card present
+// ----------------------------------------------------------------------------
+void scanSD()
+{
+	if (!card.init(SPI_FULL_SPEED, SD_CHIP_SELECT_PIN))
+	{
+		Serial.print(F("Init failed, error:"));
+		Serial.println(card.errorCode());
+		mb8877.reg[STATUS] = FDC_ST_NOTREADY;
+		return;
+	}
+
+#ifdef SD_DEBUG
+	Serial.print(F("\nCard type: "));
+	switch(card.type()) {
+		case SD_CARD_TYPE_SD1: Serial.println(F("SD1")); break;
+		case SD_CARD_TYPE_SD2: Serial.println(F("SD2")); break;
+		case SD_CARD_TYPE_SDHC: Serial.println(F("SDHC")); break;
+		default: Serial.println(F("Unknown"));
+	}
+#endif
+
+	if (readSlots())				// Slot card: no FAT volume
+	{
+		mb8877.reg[STATUS]=0x00;
+		return;
+	}
+
+	if (!volume.init(card)) {
+#ifdef SD_DEBUG
+		Serial.println(F("Could not find FAT16/FAT32 partition.\nMake sure you've formatted the card"));
+#endif
+		mb8877.reg[STATUS] = FDC_ST_NOTREADY;
+		return;
+	}
+
+#ifdef SD_DEBUG
+	// ----- Print the type and size of the first FAT-type volume
+	Serial.print(F("\nVolume type is FAT"));
+	Serial.println(volume.fatType(), DEC);
+	Serial.println();
+
+	long volumesize;
+	volumesize = volume.blocksPerCluster();    // clusters are collections of blocks
+	volumesize *= volume.clusterCount();       // we'll have a lot of clusters
+	volumesize *= 512;                            // SD card blocks are always 512 bytes
+	Serial.print(F("Volume size (bytes): "));
+	Serial.println(volumesize);
+#endif
+	root.openRoot(volume);
+	indexDisks();
+	mb8877.reg[STATUS]=0x00;
+}
+
+// Whether a file has the size of an image: raw or version 2 (image.h), with
+// or without its CRC zone
+static bool imageSize(uint32_t size)
+{
+  const uint32_t data = MB8877::Geometry::image_size,
+    zone = CRCZONE_BLOCKS(MB8877::Geometry::sector_count) * SD_BLOCK_SIZE,
+    head = IMAGE_HEAD * SD_BLOCK_SIZE;
+
+  return size == data || size == data + zone || size == head + data || size == head + data + zone;
+}
+
+// ----------------------------------------------------------------------------
+//  Index the virtual disks
+// ----------------------------------------------------------------------------
+//  One pass over the raw entries of the root directory when the card is
+//  mounted; disk changes are then answered from the index, however many
+//  other files are on the card. EEPROM cells are only written when they
+//  change, so remounting the same card costs no EEPROM wear.
+static void indexDisks(void)
+{
+  dir_t entry;
+  uint16_t  index;
+  uint32_t  cluster;
+  int n;
+
+  memset(disks, 0, sizeof(disks));
+  root.rewind();
+  while (root.readDir(&entry) > 0)
+  {
+    // 8.3 name, without the dot: DISK_nnnQX1
+    if (memcmp(entry.name, "DISK_", 5) || memcmp(entry.name + 8, "QX1", 3)) continue;
+    if ((entry.name[5] < '0')||(entry.name[5] > '9')) continue;
+    if ((entry.name[6] < '0')||(entry.name[6] > '9')) continue;
+    if ((entry.name[7] < '0')||(entry.name[7] > '9')) continue;
+    n = (entry.name[5]-'0')*100 + (entry.name[6]-'0')*10 + entry.name[7]-'0';
+    if (n > FDC_DISKS) continue;
 
-extern class MB8877 mb8877;
+    if (! imageSize(entry.fileSize))
+    {
+#ifdef SD_DEBUG
+      Serial.print(F("DISK_"));
+      Serial.print(n, DEC);
+      Serial.print(F(" bad size: "));
+      Serial.println(entry.fileSize, DEC);
+#endif
+      continue;
+    }
+
+    index = root.curPosition()/sizeof(dir_t) - 1;
+    cluster = (uint32_t)entry.firstClusterHigh << 16 | entry.firstClusterLow;
+    eeprom_update_word(&eedisks[n].index, index);
+    eeprom_update_dword(&eedisks[n].cluster, cluster);
+    disks[n >> 3] |= 1 << (n & 7);
+  }
+}
 
 // ----------------------------------------------------------------------------
-//  Scan the directory
+//  Read the slot card header
 // ----------------------------------------------------------------------------
-int scanDirectory(int wanted) {
-   int i=-1;
-   char _filename[32];
-   File entry;
+//  Block 0 of a slot card holds a struct slotcard where a FAT card has its
+//  MBR or boot sector. Only the header bytes are read; the presence bitmap
+//  becomes the disk index, so findDisk() works the same on both layouts.
+static bool readSlots(void)
+{
+  struct slotcard header;
+
+  slotFirst = slotStride = 0;
+  if (! card.readData(0, 0, sizeof(header), (uint8_t*)&header)) return false;
+  if (memcmp(header.magic, SLOT_MAGIC, sizeof(header.magic))) return false;
+  if (header.version != SLOT_VERSION || header.disks != FDC_DISKS + 1) return false;
+  if (header.first == 0 || header.stride < MB8877::Geometry::image_size / SLOT_BLOCK) return false;
+  if (header.first + (uint32_t)header.disks * header.stride > card.cardSize()) return false;
 
-  if (mb8877.reg[STATUS] & FDC_ST_NOTREADY) return FALSE; // Exit if no card
+  memcpy(disks, header.present, sizeof(disks));
+  slotFirst = header.first;
+  slotStride = header.stride;
+#ifdef SD_DEBUG
+  Serial.println(F("Slot card"));
+#endif
+  return true;
+}
 
-  droot.rewindDirectory();
-  while(true)
+// ----------------------------------------------------------------------------
+//  Find a virtual disk
+// ----------------------------------------------------------------------------
+//  First indexed disk from n, going up (step 1) or down (step -1); -1 if none.
+int findDisk(int n, int step)
+{
+  if (mb8877.reg[STATUS] & FDC_ST_NOTREADY) return -1;  // Exit if no card
+
+  for (; n >= 0 && n <= FDC_DISKS; n += step)
+    if (disks[n >> 3] & (1 << (n & 7))) return n;
+  return -1;
+}
+
+// ----------------------------------------------------------------------------
+//  Open a virtual disk
+// ----------------------------------------------------------------------------
+//  Straight from its directory entry; the first cluster tells whether the
+//  entry still holds the indexed image. Not for slot cards (see slotBlock()).
+uint8_t openDisk(SdFile *file, int n, uint8_t mode)
+{
+  if (slotFirst || findDisk(n, 1) != n) return FALSE;
+  if (! file->open(&root, eeprom_read_word(&eedisks[n].index), mode)) return FALSE;
+  if (file->firstCluster() == eeprom_read_dword(&eedisks[n].cluster)) return TRUE;
+  file->close();
+  return FALSE;
+}
+
+// ----------------------------------------------------------------------------
+//  Map a virtual disk to card blocks
+// ----------------------------------------------------------------------------
+//  Follows the cluster chain of the image once, when it is opened, and
+//  merges adjacent clusters into runs; later accesses compute the card block
+//  from the map instead of walking the chain from the start of the file.
+//  Seeking one byte into a cluster makes SdFile step to it. Returns the
+//  number of runs, 0 if the image needs more than max (fragmented card).
+int imageMap(int n, struct extent *map, int max)
+{
+  SdFile  file;
+  uint32_t  block;
+  uint16_t  i, size = volume.blocksPerCluster();
+  int runs = 0;
+
+  if (slotFirst)                  // Slot card: a single run
   {
-    entry =  droot.openNextFile();
-    if (! entry) return false;
+    if (! (map->block = slotBlock(n))) return 0;
+    map->length = MB8877::Geometry::image_size / SD_BLOCK_SIZE + CRCZONE_BLOCKS(MB8877::Geometry::sector_count);
+    if (map->length > slotStride) map->length = slotStride;
+    return 1;
+  }
 
-    if (! entry.isDirectory())
+  if (! openDisk(&file, n, O_READ)) return 0;
+  for (i = 0; i < file.fileSize() / SD_BLOCK_SIZE; i += size)   // The CRC zone too, if any
+  {
+    if (! file.seekSet((uint32_t)i * SD_BLOCK_SIZE + 1)) { runs = 0; break; }
+    fatLinks++;                   // One more link of the chain
+    block = volume.dataStartBlock() + (file.curCluster() - 2) * size;
+    if (runs && map[runs-1].block + map[runs-1].length == block)
+      map[runs-1].length += size;
+    else if (runs == max) { runs = 0; break; }
+    else
     {
-      i=-1;
-      strcpy(_filename,entry.name());
-      if (_filename[0] != 'D') continue;
-      if (_filename[1] != 'I') continue;
-      if (_filename[2] != 'S') continue;
-      if (_filename[3] != 'K') continue;
-      if (_filename[4] != '_') continue;
-      if ((_filename[5] < '0')||(_filename[5] > '9')) continue;
-      if ((_filename[6] < '0')||(_filename[6] > '9')) continue;
-      if ((_filename[7] < '0')||(_filename[7] > '9')) continue;
-      if (_filename[8] != '.') continue;
-      if (_filename[8] != 'Q') continue;
-      if (_filename[9] != 'X') continue;
-      if (_filename[10] != '1') continue;
-
-      i=_filename[5]-48;
-      i=i*10+_filename[6]-48;
-      i=i*10+_filename[7]-48;
-
-      if (i >= wanted) break;
+      map[runs].block = block;
+      map[runs].length = size;
+      runs++;
     }
   }
-  Serial.println("Fichier: ");
-  Serial.println(_filename);
-  if (entry.size() != 1556480)
+  file.close();
+  return runs;
+}
+
+// First block of disk n on a slot card; 0 if not a slot card or no such disk
+uint32_t slotBlock(int n)
+{
+  if (! slotFirst || findDisk(n, 1) != n) return 0;
+  return slotFirst + n * slotStride;
+}
+
+// Blocks a disk may use on a slot card, image and CRC zone; 0 if not a slot card
+uint32_t slotBlocks(void)
+{
+  return slotStride;
+}
+
+// ----------------------------------------------------------------------------
+//  FAT lookups
+// ----------------------------------------------------------------------------
+//  SdFile finds the cluster of a position by following the chain: from the
+//  current cluster going forward, from the first one going back. fatWalk()
+//  counts the links followed to move between two positions of a file.
+
+void fatWalk(uint32_t from, uint32_t to)
+{
+  uint32_t  size = volume.blocksPerCluster() * (uint32_t)SD_BLOCK_SIZE;
+
+  if (to / size < from / size) from = 0;
+  fatLinks += to / size - from / size;
+}
+
+unsigned int fatReads(void)
+{
+  unsigned int  n = fatLinks;
+
+  fatLinks = 0;
+  return n;
+}
+
+// ----------------------------------------------------------------------------
+//  Multi-block stream (CMD18)
+// ----------------------------------------------------------------------------
+//  Sd2Card only issues single block reads, so a run of consecutive blocks is
+//  read here with one READ_MULTIPLE_BLOCK command, talking to the card over
+//  SPI directly. The card stays selected until streamStop(), which is only
+//  called between two blocks.
+
+static uint8_t spiRec(void)
+{
+  SPDR = 0xff;
+  while (!(SPSR & (1 << SPIF)));
+  return SPDR;
+}
+
+static void spiSend(uint8_t b)
+{
+  SPDR = b;
+  while (!(SPSR & (1 << SPIF)));
+}
+
+static uint8_t streamCommand(uint8_t cmd, uint32_t arg)
+{
+  uint8_t i, status;
+
+  if (cmd != SD_CMD12)     // CMD12 comes in the middle of a block: data, not busy
+    for (i = 0; spiRec() != 0xff && i != 0xff; i++);  // Wait while the card is busy
+
+  SPDR = 0x40 | cmd; while (!(SPSR & (1 << SPIF)));
+  for (i = 0; i < 4; i++, arg <<= 8)
+  {
+    SPDR = arg >> 24; while (!(SPSR & (1 << SPIF)));
+  }
+  SPDR = 0xff; while (!(SPSR & (1 << SPIF)));        // CRC is ignored in SPI mode
+
+  // The byte after CMD12 is a stuff byte, whatever its value: drop exactly
+  // that one, or a data byte with bit 7 clear passes for R1
+  if (cmd == SD_CMD12) spiRec();
+  for (i = 0; ((status = spiRec()) & 0x80) && i != 0xff; i++);
+  return status;
+}
+
+uint8_t streamStart(uint32_t block)
+{
+  digitalWrite(SD_CHIP_SELECT_PIN, LOW);
+  if (card.type() != SD_CARD_TYPE_SDHC) block <<= 9;   // SD1/SD2 use byte addresses
+  if (streamCommand(SD_CMD18, block))
+  {
+    digitalWrite(SD_CHIP_SELECT_PIN, HIGH);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+// Wait for the next block of the stream; its bytes come with streamChunk()
+uint8_t streamBlock(void)
+{
+  uint16_t  i;
+  uint8_t  status;
+
+  for (i = 0; (status = spiRec()) == 0xff && i != 0xffff; i++);
+  if (status != SD_DATA_START) return FALSE;
+  streamLeft = SD_BLOCK_SIZE;
+  return TRUE;
+}
+
+// Next n bytes of the block into dst; the block CRC is skipped after its
+// last byte. A block may come in as many pieces as the caller likes, so
+// the card is read between two bus accesses rather than 512 bytes at once.
+uint8_t streamChunk(uint8_t *dst, uint16_t n)
+{
+  uint8_t  *end = dst + n;
+
+  if (n > streamLeft) return FALSE;
+  while (dst < end) *dst++ = spiRec();
+  if (! (streamLeft -= n))
   {
-    Serial.print(" bad size: ");
-    Serial.print(entry.size(), DEC);
-    Serial.println(" != 1556480");
+    spiRec(); spiRec();   // Skip the block CRC
   }
-  return i;
+  return TRUE;
+}
+
+void streamStop(void)
+{
+  uint16_t  i;
+
+  streamCommand(SD_CMD12, 0);    // Stuff byte, then R1
+  for (i = 0; spiRec() != 0xff && i != 0xffff; i++);   // Then busy until 0xff
+  digitalWrite(SD_CHIP_SELECT_PIN, HIGH);
+  spiRec();
 }
 
+// ----------------------------------------------------------------------------
+//  Multi-block write (ACMD23, CMD25)
+// ----------------------------------------------------------------------------
+//  Sd2Card writes one block per command, the card programming each one
+//  before the next command. A run of consecutive blocks is written here
+//  with one WRITE_MULTIPLE_BLOCK command, the run pre-erased first with
+//  SET_WR_BLK_ERASE_COUNT. The card programs a block while the next one is
+//  on its way: the busy wait comes before a block, not after it. As with
+//  the stream, the card stays selected until writeStop().
+
+// Wait while the card is busy programming; false if it takes too long
+static uint8_t cardReady(void)
+{
+  uint16_t  start = millis();
+
+  while (spiRec() != 0xff)
+    if ((uint16_t)millis() - start > SD_BUSY_TIMEOUT) return FALSE;
+  return TRUE;
+}
+
+// Pre-erasing is only a hint to the card: a card refusing it still writes
+uint8_t writeStart(uint32_t block, uint16_t count)
+{
+  digitalWrite(SD_CHIP_SELECT_PIN, LOW);
+  if (card.type() != SD_CARD_TYPE_SDHC) block <<= 9;   // SD1/SD2 use byte addresses
+  if (cardReady() && ! streamCommand(SD_CMD55, 0)) streamCommand(SD_CMD23, count);
+  if (streamCommand(SD_CMD25, block))
+  {
+    digitalWrite(SD_CHIP_SELECT_PIN, HIGH);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+uint8_t writeBlock(const uint8_t *src)
+{
+  const uint8_t  *end = src + SD_BLOCK_SIZE;
+
+  if (! cardReady()) return FALSE;      // Still programming the previous block
+  spiSend(SD_WRITE_START);
+  while (src < end) spiSend(*src++);
+  spiSend(0xff); spiSend(0xff);         // CRC is ignored in SPI mode
+  return (spiRec() & 0x1f) == SD_DATA_ACCEPTED;
+}
+
+void writeStop(void)
+{
+  cardReady();
+  spiSend(SD_STOP_TRAN);
+  spiRec();                             // Stuff byte, then busy
+  cardReady();
+  digitalWrite(SD_CHIP_SELECT_PIN, HIGH);
+  spiRec();
+}
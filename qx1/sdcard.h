@@ -17,12 +17,15 @@ References
 
 #include <SD.h>
 
-int scanDirectory(int);
+#include "hal.h"
 
-Sd2Card   card;
-SdVolume  volume;
-//SdFile    root;
-File      droot;    // Directory root
-File      disk;    // Current virtual disk
+uint8_t openDisk(SdFile*, int, uint8_t);	// FAT card: open the disk file
+uint32_t slotBlock(int);			// Slot card: first block of the disk
+uint32_t slotBlocks(void);			// Slot card: blocks per slot
+void	fatWalk(uint32_t, uint32_t);		// Count the FAT lookups of a move in a file
+
+extern Sd2Card   card;
+extern SdVolume  volume;
+extern SdFile    root;
 
 #endif
@@ -0,0 +1,37 @@
+/*
+  Yamaha QX1 floppy drive emulator
+
+  Francois Basquin, 2014 mar 20
+
+  Slot card layout. Instead of a FAT volume, the card may hold the virtual
+  disks at fixed places: block 0 carries a struct slotcard, and disk n
+  takes FDC_IMAGE_SIZE bytes from block first + n * stride. A disk is then
+  read and written by raw block number, with no directory, FAT or cluster
+  chain on the way. host/qx1img builds such a card from DISK_nnn.QX1 files.
+
+  Integers are little endian, as on the AVR.
+*/
+
+#ifndef _H_SLOTS
+#define _H_SLOTS
+
+#include <stdint.h>
+
+#include "qx1.h"
+
+#define SLOT_MAGIC	"QX1SLOTS"	// 8 bytes, no terminating zero
+#define SLOT_VERSION	1
+#define SLOT_BLOCK	512		// Card block size
+#define SLOT_FIRST	2048		// Default block of disk 0: 1 MiB, clear of any erase unit
+#define SLOT_STRIDE	3072		// Default blocks per slot: one image rounded up to 64 KiB
+
+struct slotcard {
+	char	magic[8];		// SLOT_MAGIC
+	uint16_t version;		// SLOT_VERSION
+	uint16_t disks;			// Number of slots, FDC_DISKS + 1
+	uint32_t first;			// Block of disk 0
+	uint32_t stride;		// Blocks from one disk to the next
+	uint8_t	present[FDC_DISKS/8 + 1];	// Bit n set: slot n holds a disk
+};
+
+#endif
@@ -0,0 +1,45 @@
+/*
+  Yamaha QX1 floppy drive emulator
+
+  Francois Basquin, 2014 mar 20
+
+  Trace log ring (see trace.h)
+*/
+
+#include "trace.h"
+
+static struct trace	ring[TRACE_SIZE];
+static uint8_t		head,		// Next record written
+			tail,		// Next record read
+			dropped;	// Records lost since the ring was last full
+
+static_assert(sizeof(struct trace) == 10, "trace records are 10 bytes on the wire");
+
+static bool room(void)
+{
+	return (uint8_t)(head - tail) < TRACE_SIZE;
+}
+
+void traceWrite(const struct trace *t)
+{
+	if (dropped && room())
+	{
+		ring[head % TRACE_SIZE] = *t;
+		ring[head % TRACE_SIZE].kind = TRACE_DROP;
+		ring[head++ % TRACE_SIZE].data = dropped;
+		dropped = 0;
+	}
+	if (! room())
+	{
+		if (dropped < 255) dropped++;
+		return;
+	}
+	ring[head++ % TRACE_SIZE] = *t;
+}
+
+bool traceRead(struct trace *t)
+{
+	if (head == tail) return false;
+	*t = ring[tail++ % TRACE_SIZE];
+	return true;
+}
@@ -0,0 +1,47 @@
+/*
+  Yamaha QX1 floppy drive emulator
+
+  Francois Basquin, 2014 mar 20
+
+  Trace log. The core appends a small binary record for each event worth
+  knowing about (command taken, command done, data lost, disk change) to a
+  ring in RAM; that costs a few cycles and no I/O, so tracing stays on.
+  loop() drains the ring to the serial console when the UART has room, each
+  record behind TRACE_SYNC; text printed on the console goes in between, and
+  host/qx1trace sorts the two out and pretty-prints the records.
+
+  Records are written from step() only, never from the bus interrupt, and
+  read from loop(): the ring needs no locking. A full ring drops the new
+  records and says so with a TRACE_DROP record once there is room again.
+*/
+
+#ifndef _H_TRACE
+#define _H_TRACE
+
+#include <stdint.h>
+
+#define TRACE_SIZE	16	// Records in the ring (power of 2)
+#define TRACE_SYNC	0xa5	// Sent before each record; never part of the console text
+
+// Record kinds
+#define TRACE_CMD	1	// Command taken: registers as the MPU left them
+#define TRACE_END	2	// Command done: registers and STATUS as the MPU finds them
+#define TRACE_LOST	3	// The MPU left a DRQ unanswered, data = bytes of the field moved (low byte)
+#define TRACE_INSERT	4	// Disk change, data = disk number (0xff: none)
+#define TRACE_DROP	5	// data = records lost while the ring was full (255: or more)
+
+// Packed as on the AVR, so the host reads records the way they are sent
+struct __attribute__((packed)) trace {
+	uint8_t	kind,		// TRACE_*
+		cmd,		// Command in progress, or the last one
+		track,		// Track register
+		sector,		// Sector register
+		data,		// Data register, or as the kind says
+		status;		// Status register
+	uint32_t time;		// time_qx1() (us), wrapping after 71 minutes
+};
+
+void	traceWrite(const struct trace*);	// Append a record
+bool	traceRead(struct trace*);		// Take the oldest record; false if none
+
+#endif